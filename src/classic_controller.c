@@ -0,0 +1,307 @@
+/* Name: classic_controller.c
+ * Project: classic2usb, a Wii Classic Controller to USB adapter
+ *
+ * Turns the raw controller data into the HID report: axis decoding,
+ * calibration, response curves and button mapping.
+ *
+ * License: GNU GPL v2 (see License.txt), GNU GPL v3
+ */
+
+#include "classic_controller.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "pgm_compat.h"
+#include "curves.h"
+
+/* Calibration values for the analog sticks and triggers */
+
+#define INITIAL_XMAX 100
+#define INITIAL_XMIN -100
+#define INITIAL_YMAX 100
+#define INITIAL_YMIN -100
+#define INITIAL_RXMAX 100
+#define INITIAL_RXMIN -100
+#define INITIAL_RYMAX 100
+#define INITIAL_RYMIN -100
+
+/*
+ * The scale factors are cached in Q15 and only recomputed when the range
+ * grows. They fit into 16 bits as long as max and -min stay above 64,
+ * which holds because the range starts at the INITIAL_* values and only
+ * ever grows.
+ */
+typedef struct {
+    signed char max;
+    signed char min;
+    uint16_t posScale;  /* 127 / max in Q15, rounded up */
+    uint16_t negScale;  /* 128 / -min in Q15, rounded down */
+} calibration_t;
+
+static calibration_t calibration[AXIS_COUNT];
+
+/* response curve per axis, see curves.h */
+#ifndef CURVE_X
+#define CURVE_X     CURVE_LINEAR
+#endif
+#ifndef CURVE_Y
+#define CURVE_Y     CURVE_LINEAR
+#endif
+#ifndef CURVE_RX
+#define CURVE_RX    CURVE_LINEAR
+#endif
+#ifndef CURVE_RY
+#define CURVE_RY    CURVE_LINEAR
+#endif
+
+static unsigned char axisCurve[AXIS_COUNT] = {CURVE_X, CURVE_Y, CURVE_RX, CURVE_RY};
+
+/* stick filter, see classic_controller.h */
+#ifndef AXIS_FILTER
+#define AXIS_FILTER AXIS_FILTER_NONE
+#endif
+
+#if AXIS_FILTER == AXIS_FILTER_MEDIAN3
+#define FILTER_TAPS 3
+#elif AXIS_FILTER == AXIS_FILTER_MEAN4
+#define FILTER_TAPS 4
+#elif AXIS_FILTER != AXIS_FILTER_NONE
+#error "unknown AXIS_FILTER"
+#endif
+
+#ifdef FILTER_TAPS
+/* ring buffer of the raw values of each axis, all axes share the write
+ * position. historyValid is 0 until the first sample filled the rings. */
+static signed char axisHistory[AXIS_COUNT][FILTER_TAPS];
+static unsigned char historyPos;
+static unsigned char historyValid;
+#endif
+
+/* Button remapping */
+
+static const unsigned char defaultButtonMap[BUTTON_MAP_SIZE] PROGMEM = {
+    NO_BUTTON,              // always 1
+    BUTTON_RIGHT_TRIGGER,
+    BUTTON_START,
+    BUTTON_HOME,
+    BUTTON_SELECT,
+    BUTTON_LEFT_TRIGGER,
+    BUTTON_DOWN,
+    BUTTON_RIGHT,
+    BUTTON_UP,
+    BUTTON_LEFT,
+    BUTTON_RIGHT_Z,
+    BUTTON_X,
+    BUTTON_A,
+    BUTTON_Y,
+    BUTTON_B,
+    BUTTON_LEFT_Z,
+};
+
+static unsigned char buttonMap[BUTTON_MAP_SIZE];
+
+/* report bits for every value of the four nibbles of the button bytes */
+static uint16_t buttonNibbles[4][16];
+
+/* Precomputes buttonNibbles from buttonMap */
+static void updateButtonNibbles(void) {
+    unsigned char n, v, bit;
+
+    for (n = 0; n < 4; n++) {
+        for (v = 0; v < 16; v++) {
+            uint16_t out = 0;
+            for (bit = 0; bit < 4; bit++) {
+                unsigned char target = buttonMap[n * 4 + bit];
+                if ((v & (1 << bit)) && (target < 16)) {
+                    out |= 1U << target;
+                }
+            }
+            buttonNibbles[n][v] = out;
+        }
+    }
+}
+
+static void setAxisMax(calibration_t* cal, signed char max) {
+    cal->max = max;
+    cal->posScale = (127UL * 32768UL + max - 1) / max;
+}
+
+static void setAxisMin(calibration_t* cal, signed char min) {
+    cal->min = min;
+    cal->negScale = (128UL * 32768UL) / -min;
+}
+
+/*
+ * Stretches a centered axis value to 0..255, using the calibrated range
+ * of the axis, and shapes it with the response curve of the axis. The
+ * Q15 scale factors are rounded so that the result is the exact quotient
+ * of the old x * (127.0 / max) + 128 formula, rounded the same way. The
+ * old code ran that formula in 32 bit floats on the AVR, which is off by
+ * one on the negative side for a few ranges, so a few values differ from
+ * the old firmware, e.g. 16 instead of 15 for min = -104, x = -91.
+ */
+static unsigned char scaleAxis(unsigned char axis, signed char v) {
+    calibration_t* cal = &calibration[axis];
+    unsigned char out;
+
+    if (v > cal->max) setAxisMax(cal, v);
+    if (v < cal->min) setAxisMin(cal, v);
+
+    if (v > 0) {
+        out = 128 + (unsigned char)(((uint32_t)v * cal->posScale) >> 15);
+    } else {
+        out = 128 - (unsigned char)(((uint32_t)(-v) * cal->negScale + 0x7fff) >> 15);
+    }
+    return curve_apply(axisCurve[axis], out);
+}
+
+#ifdef FILTER_TAPS
+/*
+ * Puts the raw value of an axis into its ring buffer and returns the
+ * filtered value. Integer only, the mean of four needs no division.
+ */
+static signed char filterAxis(unsigned char axis, signed char v) {
+    signed char* h = axisHistory[axis];
+
+    if (!historyValid) {
+        // the first sample fills the ring, so the filter starts settled
+        memset(h, v, FILTER_TAPS);
+    }
+    h[historyPos] = v;
+
+#if AXIS_FILTER == AXIS_FILTER_MEDIAN3
+    signed char a = h[0], b = h[1], c = h[2];
+    if (a > b) {
+        a = h[1];
+        b = h[0];
+    }
+    // now a <= b
+    if (c >= b) return b;
+    if (c <= a) return a;
+    return c;
+#else
+    int sum = h[0] + h[1] + h[2] + h[3];
+    return (sum + 2) >> 2;
+#endif
+}
+
+/* Advances the write position once all axes of a sample are filtered */
+static void filterNext(void) {
+    historyValid = 1;
+    if (++historyPos == FILTER_TAPS) {
+        historyPos = 0;
+    }
+}
+#else
+#define filterAxis(axis, v) (v)
+#define filterNext()
+#endif
+
+void classic_controller_recalibrate(void) {
+    // initialize calibration values
+    setAxisMax(&calibration[AXIS_X], INITIAL_XMAX);
+    setAxisMin(&calibration[AXIS_X], INITIAL_XMIN);
+    setAxisMax(&calibration[AXIS_Y], INITIAL_YMAX);
+    setAxisMin(&calibration[AXIS_Y], INITIAL_YMIN);
+    setAxisMax(&calibration[AXIS_RX], INITIAL_RXMAX);
+    setAxisMin(&calibration[AXIS_RX], INITIAL_RXMIN);
+    setAxisMax(&calibration[AXIS_RY], INITIAL_RYMAX);
+    setAxisMin(&calibration[AXIS_RY], INITIAL_RYMIN);
+
+#ifdef FILTER_TAPS
+    historyPos = 0;
+    historyValid = 0;
+#endif
+}
+
+void classic_controller_init(void) {
+    classic_controller_recalibrate();
+    classic_controller_load_buttons(0);
+}
+
+unsigned char classic_controller_fill_report(report_t* report, unsigned char* data) {
+    unsigned char i;
+
+    // 128 is center ??
+
+#ifdef WII_HIRES
+    // data format 3: one full byte per stick axis and trigger
+    report->x = scaleAxis(AXIS_X, filterAxis(AXIS_X, data[0] - 128));
+    report->y = scaleAxis(AXIS_Y, filterAxis(AXIS_Y, (0xff - data[2]) - 128));
+    report->Rx = scaleAxis(AXIS_RX, filterAxis(AXIS_RX, data[1] - 128));
+    report->Ry = scaleAxis(AXIS_RY, filterAxis(AXIS_RY, (0xff - data[3]) - 128));
+    report->leftTrig = data[4];
+    report->rightTrig = data[5];
+#else
+    // calculation for x-axis
+    signed char x = (((data[0] & 0x3F))<<2) - 128;
+    report->x = scaleAxis(AXIS_X, filterAxis(AXIS_X, x));
+
+    // calculation for y-axis
+    signed char y = 0xff - (((data[1] & 0x3F))<<2) - 128;
+    report->y = scaleAxis(AXIS_Y, filterAxis(AXIS_Y, y));
+
+    // calculation for Rx-axis
+    signed char Rx = (((((data[0] & 0xC0) >> 3) | ((data[1] & 0xC0) >> 5) | ((data[2] & 0x80) >> 7))) << 3) - 128;
+    report->Rx = scaleAxis(AXIS_RX, filterAxis(AXIS_RX, Rx));
+
+    // calculation for Ry-axis
+    signed char Ry = (0xff - ((((data[2] & 0x1F))) << 3)) - 128;
+    report->Ry = scaleAxis(AXIS_RY, filterAxis(AXIS_RY, Ry));
+
+#ifdef WITH_ANALOG_L_R
+    report->leftTrig = (((data[2] & 0x60) >> 2) | ((data[3] & 0xE0) >> 5)) << 3;
+    report->rightTrig = (data[3] & 0x1F) << 3;
+#endif
+#endif /* WII_HIRES */
+    filterNext();
+
+    // buttons are low active, look up the report bits nibble by nibble
+    unsigned char lo = ~data[WII_BTN_BYTE];
+    unsigned char hi = ~data[WII_BTN_BYTE + 1];
+    uint16_t buttons = buttonNibbles[0][lo & 0x0f] | buttonNibbles[1][lo >> 4]
+                     | buttonNibbles[2][hi & 0x0f] | buttonNibbles[3][hi >> 4];
+
+    report->buttons[0] = buttons;
+    report->buttons[1] = buttons >> 8;
+
+    /* a controller that feeds us 0xff has to be reinitialized, with
+     * WII_HIRES the first six bytes can all be 0xff in a valid frame */
+    for (i = 0; i < WII_DATA_LEN; i++) {
+        if (data[i] != 0xff) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+unsigned char classic_controller_set_curve(unsigned char axis, unsigned char curve) {
+    if ((axis >= AXIS_COUNT) || (curve >= CURVE_COUNT)) {
+        return 0;
+    }
+    axisCurve[axis] = curve;
+    return 1;
+}
+
+const unsigned char* classic_controller_button_map(void) {
+    return buttonMap;
+}
+
+void classic_controller_load_buttons(const unsigned char* map) {
+    if (map) {
+        memcpy(buttonMap, map, BUTTON_MAP_SIZE);
+    } else {
+        memcpy_P(buttonMap, defaultButtonMap, BUTTON_MAP_SIZE);
+    }
+    updateButtonNibbles();
+}
+
+unsigned char classic_controller_set_button(unsigned char source, unsigned char target) {
+    if (source >= BUTTON_MAP_SIZE) {
+        return 0;
+    }
+    buttonMap[source] = (target < 16) ? target : NO_BUTTON;
+    updateButtonNibbles();
+    return 1;
+}
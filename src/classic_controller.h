@@ -1,33 +1,139 @@
 #ifndef CLASSIC_CONTROLLER_H
 #define CLASSIC_CONTROLLER_H
 
-/* !!!!!!!!!!!!!! FOR NOW THIS FILE IS USELESS !!!!!!!!!!!!!!!! */
+/*
+ * Decoding of the Classic Controller data into the HID report. This file
+ * and classic_controller.c don't touch any AVR registers, so they can be
+ * compiled on the build host as well (see host/).
+ */
+
+/* Define WII_HIRES to switch the controller to data format 3, which has
+ * native 8 bit sticks and triggers but needs 8 instead of 6 bytes */
+#ifdef WII_HIRES
+#define WII_DATA_LEN    8
+#define WII_BTN_BYTE    6   /* first of the two button bytes */
+#else
+#define WII_DATA_LEN    6
+#define WII_BTN_BYTE    4
+#endif
+
+/* same as in usbconfig.h, the high resolution format comes with 8 bit
+ * triggers */
+#if defined(WII_HIRES) && !defined(WITH_ANALOG_L_R)
+#define WITH_ANALOG_L_R
+#endif
 
 typedef struct {
-    uchar   x;
-    uchar   y;
-    uchar   Rx;
-    uchar   Ry;
+    unsigned char   x;
+    unsigned char   y;
+    unsigned char   Rx;
+    unsigned char   Ry;
 #ifdef WITH_ANALOG_L_R
-    uchar   leftTrig;
-    uchar   rightTrig;
+    unsigned char   leftTrig;
+    unsigned char   rightTrig;
 #endif
-    uchar   buttons[2];
+    unsigned char   buttons[2];
 } report_t;
 
+/* analog axes, for classic_controller_set_curve() */
+#define AXIS_X      0
+#define AXIS_Y      1
+#define AXIS_RX     2
+#define AXIS_RY     3
+#define AXIS_COUNT  4
+
+/* Stick filters, selected with -DAXIS_FILTER=... The filter runs on every
+ * sample over the last few raw values of each stick axis, so the extra
+ * samples read between two host polls smooth the report instead of being
+ * overwritten. The delay is one sample (median) or one and a half samples
+ * (mean), well below one poll interval. */
+#define AXIS_FILTER_NONE    0
+#define AXIS_FILTER_MEDIAN3 1   /* median of the last 3 samples, removes spikes */
+#define AXIS_FILTER_MEAN4   2   /* mean of the last 4 samples, halves the noise */
+
+/* report buttons, for classic_controller_set_button() */
+#define BUTTON_X              0
+#define BUTTON_A              1
+#define BUTTON_B              2
+#define BUTTON_Y              3
+#define BUTTON_START          4
+#define BUTTON_SELECT         5
+#define BUTTON_HOME           6
+#define BUTTON_RIGHT_TRIGGER  7
+#define BUTTON_LEFT_TRIGGER   8
+#define BUTTON_RIGHT_Z        9
+#define BUTTON_LEFT_Z        10
+#define BUTTON_UP            11
+#define BUTTON_DOWN          12
+#define BUTTON_LEFT          13
+#define BUTTON_RIGHT         14
+#define NO_BUTTON          0xff
+
+/* size of the button map */
+#define BUTTON_MAP_SIZE 16
+
 
 /*
  * Description:
- *  This function uses the data to fill in the report.
+ *  Resets the calibration of all axes and loads the default button map.
+ */
+void classic_controller_init(void);
+
+/*
+ * Description:
+ *  Resets the calibration and the stick filter, but keeps the button map.
+ *  Used when a controller is initialized again without a restart.
+ */
+void classic_controller_recalibrate(void);
+
+/*
+ * Description:
+ *  This function uses the data to fill in the report. The calibration
+ *  grows with the values seen.
  *
  * Parameters:
  *  report : pointer to the report to be filled
- *  data   : pointer to 6 bytes of data that came from the controller
+ *  data   : pointer to WII_DATA_LEN bytes of decrypted controller data
  *
  * Returnvalue:
- *  0 in errorcase, else 1.
+ *  0 in errorcase (the controller sent nothing but 0xff), else 1.
  */
 unsigned char classic_controller_fill_report(report_t* report, unsigned char* data);
 
+/*
+ * Description:
+ *  Selects the response curve of an axis, see curves.h.
+ *
+ * Returnvalue:
+ *  0 if axis or curve are out of range. 1 else.
+ */
+unsigned char classic_controller_set_curve(unsigned char axis, unsigned char curve);
+
+/*
+ * Description:
+ *  Returns the button map. Entry n holds the report button for bit n of
+ *  the two button bytes (bits 0..7 in the first byte, 8..15 in the
+ *  second one) or NO_BUTTON. Don't change it directly.
+ */
+const unsigned char* classic_controller_button_map(void);
+
+/*
+ * Description:
+ *  Replaces the whole button map.
+ *
+ * Parameters:
+ *  map : BUTTON_MAP_SIZE entries, 0 loads the default map
+ */
+void classic_controller_load_buttons(const unsigned char* map);
+
+/*
+ * Description:
+ *  Changes one entry of the button map. Targets above 15 unmap the bit.
+ *
+ * Returnvalue:
+ *  0 if source is out of range. 1 else.
+ */
+unsigned char classic_controller_set_button(unsigned char source, unsigned char target);
+
 
 #endif
@@ -0,0 +1,30 @@
+#ifndef CURVES_H
+#define CURVES_H
+
+/*
+ * Response curves for the analog axes. Every curve except the linear one
+ * is a 256 entry table in flash that maps a stretched axis value (128 is
+ * center) to the value sent to the host. The tables are written to
+ * curve_tables.c by host/gen_curves during the build, see the Makefile
+ * for the parameters.
+ */
+
+#include "pgm_compat.h"
+
+#define CURVE_LINEAR        0   /* no shaping, no table */
+#define CURVE_DEADZONE      1   /* dead zone around center, rest stretched */
+#define CURVE_EXPONENTIAL   2   /* fine control near center */
+#define CURVE_SQUARE        3   /* radial gate stretched to square range */
+#define CURVE_COUNT         4
+
+/* tables for CURVE_DEADZONE .. CURVE_SQUARE, CURVE_LINEAR has none */
+extern const unsigned char curveTables[CURVE_COUNT - 1][256] PROGMEM;
+
+/*
+ * Description:
+ *  Maps an axis value through the given curve.
+ */
+#define curve_apply(CURVE, VALUE) \
+    ((CURVE) == CURVE_LINEAR ? (VALUE) : pgm_read_byte(&curveTables[(CURVE) - 1][(VALUE)]))
+
+#endif
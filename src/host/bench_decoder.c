@@ -0,0 +1,384 @@
+/* Name: bench_decoder.c
+ * Project: classic2usb, a Wii Classic Controller to USB adapter
+ *
+ * Benchmarks classic_controller_fill_report() on the build host. Every
+ * scenario starts from a freshly initialized decoder, so the checksum of
+ * the produced reports only changes when the decoder output changes.
+ *
+ * Usage:
+ *  bench_decoder [-n frames]            run the synthetic scenarios
+ *  bench_decoder -t file.trace ...      replay recorded traces
+ *  bench_decoder -w scenario file.trace write a scenario as trace
+ *
+ * Besides the time per frame every line shows the stick jitter: the mean
+ * change of the four stick axes from one report to the next, in report
+ * steps. It shows how much an AXIS_FILTER calms resting sticks.
+ *
+ * Trace format: plain text, one frame per line given as WII_DATA_LEN hex
+ * bytes separated by blanks, exactly as they are passed to the decoder
+ * (i.e. already decrypted). Empty lines and lines starting with '#' are
+ * ignored.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "../classic_controller.h"
+
+#define DEFAULT_FRAMES 1000000
+
+/* ------------------------------------------------------------------------- */
+/* ---------------------------- frame generation --------------------------- */
+/* ------------------------------------------------------------------------- */
+
+typedef struct {
+    unsigned char lx, ly, rx, ry;   /* 0..255, 128 is center */
+    unsigned char lt, rt;           /* 0..255 */
+    uint16_t pressed;               /* bit n is bit n of the button bytes */
+} pad_t;
+
+static uint32_t rng = 1;
+
+static uint32_t next_random(void) {
+    // xorshift32, the scenarios must be the same on every host
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+/* Packs a controller state into the data format the decoder expects */
+static void encode(const pad_t* pad, unsigned char* data) {
+    uint16_t buttons = ~pad->pressed;
+
+#ifdef WII_HIRES
+    data[0] = pad->lx;
+    data[1] = pad->rx;
+    data[2] = pad->ly;
+    data[3] = pad->ry;
+    data[4] = pad->lt;
+    data[5] = pad->rt;
+#else
+    unsigned char lx = pad->lx >> 2, ly = pad->ly >> 2;
+    unsigned char rx = pad->rx >> 3, ry = pad->ry >> 3;
+    unsigned char lt = pad->lt >> 3, rt = pad->rt >> 3;
+
+    data[0] = ((rx & 0x18) << 3) | lx;
+    data[1] = ((rx & 0x06) << 5) | ly;
+    data[2] = ((rx & 0x01) << 7) | ((lt & 0x18) << 2) | ry;
+    data[3] = ((lt & 0x07) << 5) | rt;
+#endif
+    data[WII_BTN_BYTE] = buttons;
+    data[WII_BTN_BYTE + 1] = buttons >> 8;
+}
+
+static void centered(pad_t* pad) {
+    memset(pad, 0, sizeof(*pad));
+    pad->lx = pad->ly = pad->rx = pad->ry = 128;
+}
+
+/* all sticks and triggers sweep their full range, out of phase */
+static void gen_sweep(long n, unsigned char* data) {
+    pad_t pad;
+
+    centered(&pad);
+    pad.lx = n;
+    pad.ly = n * 3;
+    pad.rx = 255 - n;
+    pad.ry = n * 5 + 64;
+    pad.lt = n * 2;
+    pad.rt = 255 - n * 2;
+    encode(&pad, data);
+}
+
+/* sticks centered, random buttons change on every frame */
+static void gen_buttons(long n, unsigned char* data) {
+    pad_t pad;
+
+    centered(&pad);
+    pad.pressed = next_random() & 0xfffe;   // bit 0 is always 1
+    encode(&pad, data);
+}
+
+/* sticks resting near center with a few steps of noise */
+static void gen_noise(long n, unsigned char* data) {
+    pad_t pad;
+
+    centered(&pad);
+    pad.lx += (int)(next_random() % 9) - 4;
+    pad.ly += (int)(next_random() % 9) - 4;
+    pad.rx += (int)(next_random() % 17) - 8;
+    pad.ry += (int)(next_random() % 17) - 8;
+    pad.lt = next_random() % 8;
+    pad.rt = next_random() % 8;
+    encode(&pad, data);
+}
+
+/* just random bytes, includes frames the controller never sends */
+static void gen_random(long n, unsigned char* data) {
+    int i;
+
+    for (i = 0; i < WII_DATA_LEN; i++) {
+        data[i] = next_random();
+    }
+}
+
+typedef struct {
+    const char* name;
+    void (*generate)(long n, unsigned char* data);
+} scenario_t;
+
+static const scenario_t scenarios[] = {
+    {"sweep", gen_sweep},
+    {"buttons", gen_buttons},
+    {"noise", gen_noise},
+    {"random", gen_random},
+};
+
+#define SCENARIO_COUNT (sizeof(scenarios) / sizeof(scenarios[0]))
+
+/* ------------------------------------------------------------------------- */
+/* ------------------------------- measuring ------------------------------- */
+/* ------------------------------------------------------------------------- */
+
+static int perf_open(uint64_t config) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static int branches_fd = -1, misses_fd = -1;
+
+static void perf_start(void) {
+    if (branches_fd >= 0) {
+        ioctl(branches_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(misses_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(branches_fd, PERF_EVENT_IOC_ENABLE, 0);
+        ioctl(misses_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+static void perf_stop(long long* branches, long long* misses) {
+    *branches = *misses = -1;
+    if (branches_fd >= 0) {
+        ioctl(branches_fd, PERF_EVENT_IOC_DISABLE, 0);
+        ioctl(misses_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(branches_fd, branches, sizeof(*branches)) != sizeof(*branches)) *branches = -1;
+        if (read(misses_fd, misses, sizeof(*misses)) != sizeof(*misses)) *misses = -1;
+    }
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int distance(unsigned char a, unsigned char b) {
+    return a > b ? a - b : b - a;
+}
+
+/*
+ * Decodes all frames and prints one result line. The frames are
+ * generated up front so only the decoder is measured.
+ */
+static void run(const char* name, unsigned char* frames, long count) {
+    report_t report, last;
+    uint32_t checksum = 2166136261u;    // FNV-1a over all reports
+    uint64_t jitter = 0;
+    long long branches, misses;
+    double start, ns;
+    long n;
+    unsigned i;
+
+    classic_controller_init();
+
+    perf_start();
+    start = now_ns();
+    for (n = 0; n < count; n++) {
+        classic_controller_fill_report(&report, frames + n * WII_DATA_LEN);
+        for (i = 0; i < sizeof(report); i++) {
+            checksum = (checksum ^ ((unsigned char*)&report)[i]) * 16777619u;
+        }
+    }
+    ns = now_ns() - start;
+    perf_stop(&branches, &misses);
+
+    // second pass for the jitter, outside of the timed loop
+    classic_controller_init();
+    for (n = 0; n < count; n++) {
+        classic_controller_fill_report(&report, frames + n * WII_DATA_LEN);
+        if (n) {
+            jitter += distance(report.x, last.x) + distance(report.y, last.y)
+                    + distance(report.Rx, last.Rx) + distance(report.Ry, last.Ry);
+        }
+        last = report;
+    }
+
+    printf("%-24s %9ld %9.1f", name, count, ns / count);
+    if (branches >= 0) {
+        printf(" %9.1f %9.2f", (double)branches / count, (double)misses / count);
+    } else {
+        printf(" %9s %9s", "-", "-");
+    }
+    printf(" %9.3f  %08x\n", count > 1 ? jitter / (4.0 * (count - 1)) : 0.0, checksum);
+}
+
+/* ------------------------------------------------------------------------- */
+/* --------------------------------- traces -------------------------------- */
+/* ------------------------------------------------------------------------- */
+
+static long read_trace(const char* file, unsigned char** frames) {
+    char line[256];
+    long count = 0, size = 1024, lineno = 0;
+    FILE* f = fopen(file, "r");
+
+    if (!f) {
+        perror(file);
+        exit(1);
+    }
+    *frames = malloc(size * WII_DATA_LEN);
+    while (fgets(line, sizeof(line), f)) {
+        char* p = line;
+        int i;
+
+        lineno++;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '#' || *p == '\n' || *p == '\r' || *p == 0) {
+            continue;
+        }
+        if (count == size) {
+            size *= 2;
+            *frames = realloc(*frames, size * WII_DATA_LEN);
+        }
+        for (i = 0; i < WII_DATA_LEN; i++) {
+            char* end;
+            unsigned long v = strtoul(p, &end, 16);
+            if (end == p || v > 0xff) {
+                fprintf(stderr, "%s:%ld: expected %d hex bytes\n", file, lineno, WII_DATA_LEN);
+                exit(1);
+            }
+            (*frames)[count * WII_DATA_LEN + i] = v;
+            p = end;
+        }
+        count++;
+    }
+    fclose(f);
+    return count;
+}
+
+static int write_trace(const char* scenario, const char* file, long count) {
+    unsigned char data[WII_DATA_LEN];
+    unsigned s;
+    long n;
+    int i;
+    FILE* f;
+
+    for (s = 0; s < SCENARIO_COUNT; s++) {
+        if (!strcmp(scenarios[s].name, scenario)) {
+            break;
+        }
+    }
+    if (s == SCENARIO_COUNT) {
+        fprintf(stderr, "unknown scenario %s\n", scenario);
+        return 1;
+    }
+    f = fopen(file, "w");
+    if (!f) {
+        perror(file);
+        return 1;
+    }
+    fprintf(f, "# classic2usb trace, %d bytes per frame, scenario %s\n", WII_DATA_LEN, scenario);
+    rng = 1;
+    for (n = 0; n < count; n++) {
+        scenarios[s].generate(n, data);
+        for (i = 0; i < WII_DATA_LEN; i++) {
+            fprintf(f, "%s%02x", i ? " " : "", data[i]);
+        }
+        fprintf(f, "\n");
+    }
+    fclose(f);
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+int main(int argc, char** argv) {
+    long count = DEFAULT_FRAMES;
+    unsigned char* frames;
+    unsigned s;
+    int opt;
+    int traces = 0;
+
+    while ((opt = getopt(argc, argv, "n:tw:")) != -1) {
+        switch (opt) {
+            case 'n':
+                count = atol(optarg);
+                break;
+            case 't':
+                traces = 1;
+                break;
+            case 'w':
+                if (optind >= argc) {
+                    fprintf(stderr, "-w needs a scenario and a file\n");
+                    return 1;
+                }
+                return write_trace(optarg, argv[optind], count);
+            default:
+                fprintf(stderr, "usage: %s [-n frames] [-t trace...] [-w scenario file]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (count <= 0) {
+        count = DEFAULT_FRAMES;
+    }
+
+    branches_fd = perf_open(PERF_COUNT_HW_BRANCH_INSTRUCTIONS);
+    misses_fd = perf_open(PERF_COUNT_HW_BRANCH_MISSES);
+    if (branches_fd < 0 || misses_fd < 0) {
+        branches_fd = -1;   // no branch counters, e.g. in a container
+    }
+
+    printf("# %d bytes per frame, report_t has %u bytes\n", WII_DATA_LEN, (unsigned)sizeof(report_t));
+    printf("%-24s %9s %9s %9s %9s %9s  %s\n", "scenario", "frames", "ns/frame", "br/frame", "miss/fr", "jitter", "checksum");
+
+    if (traces) {
+        for (; optind < argc; optind++) {
+            long n = read_trace(argv[optind], &frames);
+            run(argv[optind], frames, n);
+            free(frames);
+        }
+        return 0;
+    }
+
+    frames = malloc(count * WII_DATA_LEN);
+    for (s = 0; s < SCENARIO_COUNT; s++) {
+        long n;
+
+        rng = 1;
+        for (n = 0; n < count; n++) {
+            scenarios[s].generate(n, frames + n * WII_DATA_LEN);
+        }
+        run(scenarios[s].name, frames, count);
+    }
+    free(frames);
+
+    return 0;
+}
@@ -0,0 +1,68 @@
+/* Name: check_curves.c
+ * Project: classic2usb, a Wii Classic Controller to USB adapter
+ *
+ * Checks the generated tables in curve_tables.c against a straight
+ * reference implementation of the curves. Built and run by the Makefile
+ * right after the tables have been generated, a failure stops the build.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "../curves.h"
+
+#ifndef CURVE_DEADZONE_PERCENT
+#error define CURVE_DEADZONE_PERCENT and CURVE_EXPO_X10 like for gen_curves
+#endif
+
+/* reference for one half axis, a is the distance from center in steps */
+static double reference(int curve, double a, double half) {
+    double dz = CURVE_DEADZONE_PERCENT * half / 100.0;
+    double e = CURVE_EXPO_X10 / 10.0;
+
+    switch (curve) {
+        case CURVE_DEADZONE:
+            return (a <= dz) ? 0.0 : (a - dz) * half / (half - dz);
+        case CURVE_EXPONENTIAL:
+            return half * expm1(e * a / half) / expm1(e);
+        case CURVE_SQUARE:
+            return fmin(half, a * M_SQRT2);
+    }
+    return a;
+}
+
+int main(void) {
+    int curve, v, errors = 0;
+
+    for (curve = 1; curve < CURVE_COUNT; curve++) {
+        const unsigned char* table = curveTables[curve - 1];
+
+        for (v = 0; v < 256; v++) {
+            int d = v - 128;
+            double half = (d < 0) ? 128.0 : 127.0;
+            double r = reference(curve, fabs(d), half);
+            int expected = 128 + (d < 0 ? -1 : 1) * (int)floor(r + 0.5);
+
+            // allow for rounding of values that sit right on .5
+            if (abs(table[v] - expected) > 1 || (table[v] != expected && fabs(r - floor(r) - 0.5) > 1e-9)) {
+                printf("curve %d: table[%d] = %d, expected %d\n", curve, v, table[v], expected);
+                errors++;
+            }
+            if (v > 0 && table[v] < table[v - 1]) {
+                printf("curve %d: not monotonic at %d\n", curve, v);
+                errors++;
+            }
+        }
+        if (table[0] != 0 || table[128] != 128 || table[255] != 255) {
+            printf("curve %d: end points or center are off\n", curve);
+            errors++;
+        }
+    }
+
+    if (errors) {
+        printf("check_curves: %d errors\n", errors);
+        return 1;
+    }
+    return 0;
+}
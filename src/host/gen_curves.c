@@ -0,0 +1,82 @@
+/* Name: gen_curves.c
+ * Project: classic2usb, a Wii Classic Controller to USB adapter
+ *
+ * Runs on the build host and writes the response curve tables of
+ * curves.h as C source to stdout.
+ *
+ * Usage: gen_curves <deadzone percent> <exponent * 10>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "../curves.h"
+
+static double deadzone;     /* fraction of the half axis */
+static double exponent;
+
+/* all curves work on -1..1 and are mirrored around center */
+static double shape(int curve, double n) {
+    double a = fabs(n);
+    double r = a;
+
+    switch (curve) {
+        case CURVE_DEADZONE:
+            r = (a <= deadzone) ? 0.0 : (a - deadzone) / (1.0 - deadzone);
+            break;
+        case CURVE_EXPONENTIAL:
+            r = (exp(exponent * a) - 1.0) / (exp(exponent) - 1.0);
+            break;
+        case CURVE_SQUARE:
+            // a round gate only reaches 1/sqrt(2) per axis on the diagonals
+            r = a * sqrt(2.0);
+            if (r > 1.0) r = 1.0;
+            break;
+    }
+    return (n < 0) ? -r : r;
+}
+
+static int map(int curve, int v) {
+    int d = v - 128;
+    double out;
+
+    // 128 is center, there are 127 steps above and 128 below
+    if (d >= 0) {
+        out = 128.0 + floor(shape(curve, d / 127.0) * 127.0 + 0.5);
+    } else {
+        out = 128.0 + floor(shape(curve, d / 128.0) * 128.0 + 0.5);
+    }
+    if (out < 0) out = 0;
+    if (out > 255) out = 255;
+    return (int)out;
+}
+
+int main(int argc, char** argv) {
+    int curve, v;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <deadzone percent> <exponent * 10>\n", argv[0]);
+        return 1;
+    }
+    deadzone = atoi(argv[1]) / 100.0;
+    exponent = atoi(argv[2]) / 10.0;
+    if (deadzone < 0.0 || deadzone >= 1.0 || exponent <= 0.0) {
+        fprintf(stderr, "%s: parameters out of range\n", argv[0]);
+        return 1;
+    }
+
+    printf("/* generated by host/gen_curves %s %s, do not edit */\n\n", argv[1], argv[2]);
+    printf("#include \"curves.h\"\n\n");
+    printf("const unsigned char curveTables[CURVE_COUNT - 1][256] PROGMEM = {\n");
+    for (curve = 1; curve < CURVE_COUNT; curve++) {
+        printf("    {");
+        for (v = 0; v < 256; v++) {
+            printf("%s%3d,", (v % 16) ? " " : "\n        ", map(curve, v));
+        }
+        printf("\n    },\n");
+    }
+    printf("};\n");
+
+    return 0;
+}
@@ -0,0 +1,15 @@
+/* Name: interrupt.h
+ * Project: classic2usb, a Wii Classic Controller to USB adapter
+ *
+ * Replaces <avr/interrupt.h> for the host build of twi_func.c. Interrupt
+ * handlers become plain functions.
+ */
+
+#ifndef MOCK_AVR_INTERRUPT_H
+#define MOCK_AVR_INTERRUPT_H
+
+#define ISR(vector, ...) void vector(void); void vector(void)
+#define sei()
+#define cli()
+
+#endif
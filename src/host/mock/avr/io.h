@@ -0,0 +1,54 @@
+/* Name: io.h
+ * Project: classic2usb, a Wii Classic Controller to USB adapter
+ *
+ * Replaces <avr/io.h> when twi_func.c is built on the host, see
+ * host/twi_mock.c. Every register access goes through the mock so it can
+ * see the writes of the driver and advance the simulated TWI.
+ *
+ * The timer1 registers for my_timers.c are plain variables, they are
+ * defined by host/timer_check.c.
+ */
+
+#ifndef MOCK_AVR_IO_H
+#define MOCK_AVR_IO_H
+
+#include <stdint.h>
+
+volatile uint8_t* twi_mock_twcr(void);
+volatile uint8_t* twi_mock_twsr(void);
+volatile uint8_t* twi_mock_twdr(void);
+volatile uint8_t* twi_mock_twbr(void);
+volatile uint8_t* twi_mock_portc(void);
+volatile uint8_t* twi_mock_ddrc(void);
+volatile uint8_t* twi_mock_pinc(void);
+
+#define TWCR (*twi_mock_twcr())
+#define TWSR (*twi_mock_twsr())
+#define TWDR (*twi_mock_twdr())
+#define TWBR (*twi_mock_twbr())
+#define PORTC (*twi_mock_portc())
+#define DDRC (*twi_mock_ddrc())
+#define PINC (*twi_mock_pinc())
+
+#define TWINT   7
+#define TWEA    6
+#define TWSTA   5
+#define TWSTO   4
+#define TWWC    3
+#define TWEN    2
+#define TWIE    0
+
+#define PC4     4   // SDA
+#define PC5     5   // SCL
+
+extern volatile uint8_t TCCR1A, TCCR1B, TIMSK, TIFR;
+extern volatile uint16_t TCNT1, OCR1A, OCR1B;
+
+#define CS10    0
+#define CS11    1
+#define OCIE1B  3
+#define OCIE1A  4
+#define OCF1B   3
+#define OCF1A   4
+
+#endif
@@ -0,0 +1,15 @@
+/* Name: atomic.h
+ * Project: classic2usb, a Wii Classic Controller to USB adapter
+ *
+ * Replaces <util/atomic.h> for the host build of twi_func.c. The mock has
+ * no interrupts, so a block just runs once.
+ */
+
+#ifndef MOCK_UTIL_ATOMIC_H
+#define MOCK_UTIL_ATOMIC_H
+
+#define ATOMIC_BLOCK(type) for (int atomic_once = 1; atomic_once; atomic_once = 0)
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_FORCEON
+
+#endif
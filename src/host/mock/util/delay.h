@@ -0,0 +1,14 @@
+/* Name: delay.h
+ * Project: classic2usb, a Wii Classic Controller to USB adapter
+ *
+ * Replaces <util/delay.h> for the host build of twi_func.c. The mock
+ * accounts the delays as stall time instead of waiting.
+ */
+
+#ifndef MOCK_UTIL_DELAY_H
+#define MOCK_UTIL_DELAY_H
+
+void _delay_us(double us);
+void _delay_ms(double ms);
+
+#endif
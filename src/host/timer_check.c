@@ -0,0 +1,334 @@
+/* Name: timer_check.c
+ * Project: classic2usb, a Wii Classic Controller to USB adapter
+ *
+ * Runs the software timers of my_timers.c and the protothreads of pt.h on
+ * the build host. The tick interrupt is called directly, normally followed
+ * by my_timer_run() like the main loop does, and every probe timer checks
+ * that it expires in the tick it was started for. The scenarios cover
+ * timers that share a slot of the wheel, timers longer than a turn of it,
+ * timers stopped and started again from callbacks, a main loop that falls
+ * behind and the wrap of the millisecond counter. Fails if a timer fires
+ * early, late, twice or after it was stopped.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <avr/io.h>
+
+#include "my_timers.h"
+#include "pt.h"
+
+volatile uint8_t TCCR1A, TCCR1B, TIMSK, TIFR;
+volatile uint16_t TCNT1, OCR1A, OCR1B;
+
+void TIMER1_COMPB_vect(void);
+
+#define PROBES 48
+
+typedef struct probe_s {
+    my_timer_t timer;
+    uint16_t due;               // tick it has to expire in
+    uint16_t period;            // started again with it, 0: oneshot
+    struct probe_s* victim;     // stopped by the callback
+    unsigned fires, wrong;
+} probe_t;
+
+static probe_t probes[PROBES];
+static uint8_t fireOrder[PROBES];
+static unsigned fireCount;
+static uint8_t lagging;         // my_timer_run() is behind, only check the order
+
+static void tick(void) {
+    TCNT1 += MY_TIMER_MS(1);
+    TIMER1_COMPB_vect();
+}
+
+/* lets the time pass like the main loop sees it */
+static void advance(unsigned ms) {
+    while (ms--) {
+        tick();
+        my_timer_run();
+    }
+}
+
+static void probe_fired(void* ptr) {
+    probe_t* p = ptr;
+
+    p->fires++;
+    if (!lagging && my_timer_ms() != p->due) {
+        p->wrong++;
+    }
+    if (fireCount < PROBES) {
+        fireOrder[fireCount++] = p - probes;
+    }
+    if (p->period) {
+        p->due += p->period;
+        my_timer_start(&p->timer, p->period, probe_fired, p);
+    }
+    if (p->victim) {
+        my_timer_stop(&p->victim->timer);
+    }
+}
+
+static void reset_probes(void) {
+    unsigned i;
+
+    for (i = 0; i < PROBES; i++) {
+        my_timer_stop(&probes[i].timer);
+    }
+    memset(probes, 0, sizeof(probes));
+    fireCount = 0;
+    lagging = 0;
+}
+
+static void start_probe(unsigned i, uint16_t ms, uint16_t period) {
+    probes[i].due = my_timer_ms() + ms;
+    probes[i].period = period;
+    my_timer_start(&probes[i].timer, ms, probe_fired, &probes[i]);
+}
+
+/* counts the probes that did not fire as often as given, or off time */
+static unsigned check_probes(unsigned count, const unsigned* fires) {
+    unsigned i, bad = 0;
+
+    for (i = 0; i < count; i++) {
+        if (probes[i].fires != fires[i] || probes[i].wrong) {
+            bad++;
+        }
+    }
+    return bad;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static unsigned one_at_a_time(void) {
+    static const unsigned once[1] = {1};
+    unsigned ms, bad = 0;
+
+    for (ms = 1; ms <= 5 * MY_TIMER_SLOTS; ms++) {
+        reset_probes();
+        start_probe(0, ms, 0);
+        advance(ms + 2 * MY_TIMER_SLOTS);
+        bad += check_probes(1, once);
+    }
+    return bad;
+}
+
+static unsigned many_at_once(void) {
+    unsigned fires[PROBES];
+    unsigned i;
+
+    reset_probes();
+    for (i = 0; i < PROBES; i++) {
+        start_probe(i, (i * 7) % (5 * MY_TIMER_SLOTS) + 1, 0);
+        fires[i] = 1;
+    }
+    advance(6 * MY_TIMER_SLOTS);
+    return check_probes(PROBES, fires);
+}
+
+static unsigned stopped_in_slot(void) {
+    static const unsigned fires[6] = {1, 0, 1, 0, 1, 1};
+    unsigned i;
+
+    // all in the same slot, one turn of the wheel apart
+    reset_probes();
+    for (i = 0; i < 6; i++) {
+        start_probe(i, 3 + i * MY_TIMER_SLOTS, 0);
+    }
+    my_timer_stop(&probes[1].timer);
+    my_timer_stop(&probes[3].timer);
+    my_timer_stop(&probes[3].timer);    // twice does no harm
+    advance(8 * MY_TIMER_SLOTS);
+    return check_probes(6, fires);
+}
+
+static unsigned periodic(void) {
+    static const unsigned fires[4] = {96, 12, 6, 19};
+
+    // 8 and 16 land in the slot that is being processed
+    reset_probes();
+    start_probe(0, 1, 1);
+    start_probe(1, MY_TIMER_SLOTS, MY_TIMER_SLOTS);
+    start_probe(2, 2 * MY_TIMER_SLOTS, 2 * MY_TIMER_SLOTS);
+    start_probe(3, 5, 5);
+    advance(96);
+    return check_probes(4, fires);
+}
+
+static unsigned stopped_by_callback(void) {
+    static const unsigned fires[4] = {1, 0, 0, 1};
+
+    // the slot holds 3, 0, 2, 1: 3 stops one of a later turn, 0 one of this
+    reset_probes();
+    start_probe(1, 5, 0);
+    start_probe(2, 5 + MY_TIMER_SLOTS, 0);
+    start_probe(0, 5, 0);
+    start_probe(3, 5, 0);
+    probes[3].victim = &probes[2];
+    probes[0].victim = &probes[1];
+    advance(3 * MY_TIMER_SLOTS);
+    return check_probes(4, fires);
+}
+
+static unsigned started_again(void) {
+    static const unsigned fires[1] = {1};
+
+    reset_probes();
+    start_probe(0, 10, 0);
+    advance(5);
+    start_probe(0, 10, 0);
+    advance(30);
+    return check_probes(1, fires);
+}
+
+static unsigned behind(void) {
+    unsigned fires[10];
+    unsigned i, bad;
+
+    reset_probes();
+    for (i = 0; i < 10; i++) {
+        start_probe(i, 50 - i * 5, 0);
+        fires[i] = 1;
+    }
+    for (i = 0; i < 60; i++) {
+        tick();
+    }
+    lagging = 1;
+    bad = (my_timer_run() != 60);
+    bad += check_probes(10, fires);
+    // the one that was due first comes first
+    for (i = 0; i < fireCount; i++) {
+        if (fireOrder[i] != 9 - i) {
+            bad++;
+        }
+    }
+    return bad;
+}
+
+static unsigned wrap(void) {
+    static const unsigned fires[3] = {1, 1, 1};
+
+    reset_probes();
+    advance((uint16_t)(0 - my_timer_ms()) - 10);
+    start_probe(0, 5, 0);
+    start_probe(1, 10, 0);
+    start_probe(2, 30, 0);
+    advance(40);
+    return check_probes(3, fires);
+}
+
+/* ------------------------------------------------------------------------- */
+
+static pt_t mainPt, childPt;
+static uint16_t marks[8];
+static unsigned markCount;
+
+static void mark(void) {
+    if (markCount < sizeof(marks) / sizeof(marks[0])) {
+        marks[markCount++] = my_timer_ms();
+    }
+}
+
+static uint8_t child_task(pt_t* pt) {
+    PT_BEGIN(pt);
+    PT_SLEEP(pt, 3);
+    mark();
+    PT_SLEEP(pt, 3);
+    mark();
+    PT_END(pt);
+}
+
+static uint8_t main_task(pt_t* pt) {
+    PT_BEGIN(pt);
+    mark();
+    PT_SLEEP(pt, 5);
+    mark();
+    PT_YIELD(pt);
+    mark();
+    PT_SPAWN(pt, &childPt, child_task(&childPt));
+    mark();
+    PT_SLEEP(pt, 2 * MY_TIMER_SLOTS);
+    mark();
+    PT_END(pt);
+}
+
+/* runs the task once per tick until it ends, returns the ticks */
+static unsigned run_task(void) {
+    unsigned ms = 0;
+
+    while (main_task(&mainPt) != PT_ENDED && ms < 100) {
+        advance(1);
+        ms++;
+    }
+    return ms;
+}
+
+static unsigned protothreads(void) {
+    static const uint16_t expect[7] = {0, 5, 6, 9, 12, 12, 12 + 2 * MY_TIMER_SLOTS};
+    uint16_t start = my_timer_ms();
+    unsigned i, bad = 0;
+
+    markCount = 0;
+    PT_INIT(&mainPt);
+    run_task();
+    bad += (markCount != 7);
+    for (i = 0; i < markCount; i++) {
+        if ((uint16_t)(marks[i] - start) != expect[i]) {
+            bad++;
+        }
+    }
+
+    // starting over cancels the sleep, the task begins at the top
+    markCount = 0;
+    PT_INIT(&mainPt);
+    main_task(&mainPt);
+    advance(2);
+    PT_INIT(&mainPt);
+    bad += mainPt.timer.active;
+    advance(10);
+    bad += (markCount != 1);
+    return bad;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static const struct {
+    const char* name;
+    unsigned (*run)(void);
+} scenarios[] = {
+    {"1 to 40 ms, one at a time", one_at_a_time},
+    {"48 timers at once",         many_at_once},
+    {"stopped in a shared slot",  stopped_in_slot},
+    {"periodic, same slot",       periodic},
+    {"stopped by a callback",     stopped_by_callback},
+    {"started again",             started_again},
+    {"run behind by 60 ticks",    behind},
+    {"ms counter wraps",          wrap},
+    {"protothreads",              protothreads},
+};
+
+#define SCENARIO_COUNT (sizeof(scenarios) / sizeof(scenarios[0]))
+
+int main(void) {
+    unsigned s, failed = 0;
+
+    my_timer_init();
+    printf("# %d slots, tick every %u timer1 ticks\n", MY_TIMER_SLOTS, MY_TIMER_MS(1));
+    printf("%-28s %5s  %s\n", "scenario", "bad", "check");
+    if (!(TIMSK & (1<<OCIE1B)) || OCR1B != MY_TIMER_MS(1)) {
+        printf("%-28s %5s  %s\n", "tick interrupt", "-", "failed");
+        failed++;
+    }
+    for (s = 0; s < SCENARIO_COUNT; s++) {
+        unsigned bad = scenarios[s].run();
+
+        if (bad) {
+            failed++;
+        }
+        printf("%-28s %5u  %s\n", scenarios[s].name, bad, bad ? "failed" : "ok");
+    }
+    printf("# %u of %u scenarios failed\n", failed, (unsigned)SCENARIO_COUNT + 1);
+    return failed ? 1 : 0;
+}
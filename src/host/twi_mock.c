@@ -0,0 +1,573 @@
+/* Name: twi_mock.c
+ * Project: classic2usb, a Wii Classic Controller to USB adapter
+ *
+ * Runs the blocking functions of twi_func.c against a simulated TWI on the
+ * build host. Every scenario scripts the answer of the bus to one step of
+ * a transfer (0 = START, 1 = SLA+R/W, 2.. = data bytes): a NACK, lost
+ * arbitration, a bus error or a TWINT that is never set again. The mock
+ * keeps a simulated clock: every read of TWCR while TWINT is clear, i.e.
+ * every iteration of the wait loop, advances it by the estimated cycles of
+ * one iteration, and my_timer_now() reads timer1 from it. So the timeouts
+ * of the driver run on the same clock as the bus and the mock can check
+ * that no failure mode stalls the AVR longer than the configured budget.
+ * The last scenario starts an asynchronous read on a dead bus and checks
+ * that twi_status() gives up in time. The asynchronous engine runs with
+ * the interrupt handler called whenever TWINT is set.
+ *
+ * SDA and SCL are simulated as open drain lines on PORTC, so twi_bus_clear()
+ * can be run against a slave that holds SDA low until it has seen a number
+ * of clock pulses, or that holds SCL low for good. In the stuck scenarios
+ * the slave holds SDA as well, and the driver has to leave the bus free.
+ *
+ * At the end the bus time of a sample, the 0x00 request and the read of
+ * six bytes, is compared for separate transactions and for the combined
+ * write/read with a STOP or a repeated START in between.
+ *
+ * The register macros of host/mock/avr/io.h call into the mock, which
+ * can't tell reads from writes. So TWCR is handed out with the reserved
+ * bit 1 set, which the driver never writes. If the value has changed at
+ * the next register access, the driver wrote TWCR in between.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "twi_func.h"
+#include "my_timers.h"
+#include "bit_tools.h"
+
+#ifndef F_CPU
+#define F_CPU 16000000UL
+#endif
+#ifndef TW_SCL
+#define TW_SCL 100000UL    // as in main.c
+#endif
+
+/* Estimated AVR cycles of one iteration of twi_wait(): reading TWCR,
+ * testing TWINT, my_timer_now() and the two 16 bit compares. Check the
+ * listing when the loop changes. */
+#define WAIT_CYCLES_PER_POLL 30
+/* a byte (or START) on the bus takes 9 SCL periods */
+#define BYTE_POLLS (9UL * F_CPU / TW_SCL / WAIT_CYCLES_PER_POLL)
+/* a START takes about two SCL periods */
+#define START_POLLS (2UL * F_CPU / TW_SCL / WAIT_CYCLES_PER_POLL)
+/* a STOP and the bus free time after it, about one SCL period */
+#define STOP_POLLS (F_CPU / TW_SCL / WAIT_CYCLES_PER_POLL)
+/* a slow slave stretches every byte to 200 us, below the byte timeout */
+#define SLOW_POLLS (200UL * (F_CPU / 1000000UL) / WAIT_CYCLES_PER_POLL)
+/* a timeout is noticed up to one timer tick and one iteration late */
+#define SLACK_CYCLES (MY_TIMER_PRESCALER + WAIT_CYCLES_PER_POLL)
+/* no single wait and no transaction may take longer, the STOP after a
+ * transaction adds its delay */
+#define MAX_WAIT_CYCLES (TWI_BYTE_TIMEOUT_US * (F_CPU / 1000000UL) + SLACK_CYCLES)
+#define MAX_XFER_CYCLES (TWI_XFER_TIMEOUT_US * (F_CPU / 1000000UL) + MAX_CLEAR_CYCLES)
+/* cycles of one iteration of the wait for SCL in twi_bus_clear() */
+#define PIN_POLL_CYCLES 20
+/* pulses a stuck slave needs to let go of SDA in the transfer scenarios */
+#define STUCK_SDA_PULSES 4
+/* twi_bus_clear() waits for SCL, then clocks nine pulses and a STOP */
+#define MAX_CLEAR_CYCLES (TWI_CLEAR_TIMEOUT_US * (F_CPU / 1000000UL) + SLACK_CYCLES)
+/* twi_status() is polled this often in the asynchronous scenario */
+#define STATUS_POLL_CYCLES 200
+
+#define TWCR_MARKER (1<<1)
+
+/* answers of the simulated bus */
+#define ANSWER_OK       0
+#define ANSWER_NACK     1
+#define ANSWER_ARB_LOST 2
+#define ANSWER_BUS_ERR  3
+#define ANSWER_STUCK    4   // TWINT is never set, the slave holds SDA low
+#define ANSWER_REPSTART 5   // START reports 0x10 instead of 0x08
+#define ANSWER_SLOW     6   // this and every later step is stretched
+
+#define STEP_IDLE 0xff
+
+static const char* answerNames[] = {"ok", "nack", "arb lost", "bus error", "stuck", "rep start", "slow"};
+
+/* ------------------------------------------------------------------------- */
+/* -------------------------- simulated peripheral ------------------------- */
+/* ------------------------------------------------------------------------- */
+
+static struct {
+    uint8_t twcr, twsr, twdr, twbr;     // what the hardware shows
+    uint8_t twcrOut;                    // TWCR as handed to the driver
+
+    uint8_t failStep, answer;           // script of the scenario
+    uint8_t step;                       // current step, STEP_IDLE between transfers
+    uint8_t sla;
+    uint8_t stuck;
+    uint8_t repStart;                   // START during a transfer
+    uint8_t pendingStatus;
+    uint8_t stopping;                   // a STOP is going out
+    uint8_t busy;                       // a step is in progress
+    unsigned long long doneAt;          // cycle when it completes
+
+    uint8_t sent[16], sentLen;
+    unsigned waits, stops, disables;
+    unsigned long polls, pollsThisWait, maxPolls;
+    unsigned long long cycles;          // simulated clock of the AVR
+
+    uint8_t portc, ddrc, pinc;          // port of the TWI pins
+    uint8_t sda, scl;                   // levels on the bus
+    uint8_t sdaHold;                    // pulses until the slave lets go of SDA
+    uint8_t sclHold;                    // the slave holds SCL low for good
+    unsigned pulses, pinStops;          // seen while the pins were port pins
+} twi;
+
+static void twi_mock_reset(uint8_t failStep, uint8_t answer) {
+    memset(&twi, 0, sizeof(twi));
+    twi.twsr = 0xf8;                    // no relevant state
+    twi.step = STEP_IDLE;
+    twi.failStep = failStep;
+    twi.answer = answer;
+    twi.sda = twi.scl = 1;
+    twi.pinc = (1<<PC4) | (1<<PC5);
+    if (answer == ANSWER_STUCK) {
+        twi.sdaHold = STUCK_SDA_PULSES;
+    }
+}
+
+static uint8_t status_of(uint8_t answer, uint8_t ok, uint8_t nack) {
+    switch (answer) {
+        case ANSWER_OK:       return ok;
+        case ANSWER_NACK:     return nack;
+        case ANSWER_ARB_LOST: return 0x38;
+        default:              return 0x00;
+    }
+}
+
+/* starts the next step of the transfer after the driver cleared TWINT */
+static void start_step(uint8_t command) {
+    uint8_t slow = (twi.answer == ANSWER_SLOW) && (twi.step >= twi.failStep);
+    uint8_t answer = (twi.step == twi.failStep && !slow) ? twi.answer : ANSWER_OK;
+
+    if (twi.step == 0) {
+        twi.pendingStatus = (answer == ANSWER_REPSTART || twi.repStart) ? 0x10 : status_of(answer, 0x08, 0x00);
+    } else if (twi.step == 1) {
+        twi.sla = twi.twdr;
+        twi.pendingStatus = (twi.sla & 1) ? status_of(answer, 0x40, 0x48) : status_of(answer, 0x18, 0x20);
+    } else if (twi.sla & 1) {
+        twi.pendingStatus = status_of(answer, (command & (1<<TWEA)) ? 0x50 : 0x58, 0x58);
+    } else {
+        twi.pendingStatus = status_of(answer, 0x28, 0x30);
+        if (answer == ANSWER_OK && twi.sentLen < sizeof(twi.sent)) {
+            twi.sent[twi.sentLen++] = twi.twdr;
+        }
+    }
+    if (answer == ANSWER_STUCK) {
+        twi.stuck = 1;      // the bus stays dead until the next scenario
+    }
+    twi.busy = 1;
+    twi.doneAt = twi.cycles + WAIT_CYCLES_PER_POLL *
+        (slow ? SLOW_POLLS : (twi.step == 0) ? START_POLLS : BYTE_POLLS);
+    twi.pollsThisWait = 0;
+    twi.waits++;
+}
+
+static void write_twcr(uint8_t value) {
+    if (!(value & (1<<TWEN))) {
+        // switching the TWI off releases the bus
+        twi.twcr = value;
+        twi.step = STEP_IDLE;
+        twi.disables++;
+        return;
+    }
+    if (!(value & (1<<TWINT))) {
+        // only the enable bits change, the flag stays as it is
+        twi.twcr = (twi.twcr & (1<<TWINT)) | value;
+        return;
+    }
+    // writing a one clears TWINT and starts the next action
+    twi.twcr = value & ~(1<<TWINT);
+    twi.repStart = 0;
+    if (value & (1<<TWSTO)) {
+        twi.stops++;
+        twi.step = STEP_IDLE;
+        twi.busy = 0;
+        if (value & (1<<TWSTA)) {
+            // STOP, then START, TWSTO is cleared in between
+            twi.twcr &= ~(1<<TWSTO);
+            twi.cycles += STOP_POLLS * WAIT_CYCLES_PER_POLL;
+        } else {
+            // a dead bus never gets its STOP
+            twi.stopping = !twi.stuck;
+            twi.doneAt = twi.cycles + STOP_POLLS * WAIT_CYCLES_PER_POLL;
+            return;
+        }
+    }
+    if (value & (1<<TWSTA)) {
+        twi.repStart = (twi.step != STEP_IDLE);
+        twi.step = 0;
+    } else if (twi.step != STEP_IDLE && !twi.stuck) {
+        twi.step++;
+    } else {
+        twi.busy = 0;       // nothing happens on a dead bus
+        return;
+    }
+    start_step(value);
+}
+
+/* puts the port on the bus, a line is low if anyone pulls it down */
+static void pins_update(void) {
+    uint8_t scl = !(GET_BIT(twi.ddrc, PC5) && !GET_BIT(twi.portc, PC5)) && !twi.sclHold;
+    uint8_t sda;
+
+    if (twi.scl && !scl && twi.sdaHold) {
+        // the slave shifts out its next bit
+        twi.pulses++;
+        twi.sdaHold--;
+    }
+    sda = !(GET_BIT(twi.ddrc, PC4) && !GET_BIT(twi.portc, PC4)) && !twi.sdaHold;
+    if (!twi.sda && sda && scl) {
+        twi.pinStops++;
+    }
+    twi.sda = sda;
+    twi.scl = scl;
+    twi.pinc = (sda << PC4) | (scl << PC5);
+}
+
+/* commits a write of the driver since the last register access */
+static void sync(void) {
+    if (twi.twcrOut != ((twi.twcr & ~TWCR_MARKER) | TWCR_MARKER)) {
+        write_twcr(twi.twcrOut & ~TWCR_MARKER);
+    }
+    twi.twcrOut = twi.twcr | TWCR_MARKER;
+    pins_update();
+}
+
+volatile uint8_t* twi_mock_twcr(void) {
+    sync();
+    if ((twi.twcr & (1<<TWSTO)) && twi.stopping) {
+        twi.cycles += WAIT_CYCLES_PER_POLL;
+        if (twi.cycles >= twi.doneAt) {
+            twi.stopping = 0;
+            twi.twcr &= ~(1<<TWSTO);    // the STOP is on the bus now
+            twi.twcrOut = twi.twcr | TWCR_MARKER;
+        }
+    }
+    if (!(twi.twcr & (1<<TWINT)) && twi.busy) {
+        twi.cycles += WAIT_CYCLES_PER_POLL;
+        twi.polls++;
+        if (++twi.pollsThisWait > twi.maxPolls) {
+            twi.maxPolls = twi.pollsThisWait;
+        }
+        if (!twi.stuck && twi.cycles >= twi.doneAt) {
+            twi.busy = 0;
+            twi.twcr |= (1<<TWINT);
+            twi.twsr = (twi.twsr & 0x03) | twi.pendingStatus;
+            if (twi.pendingStatus == 0x50) {
+                twi.twdr = 0xa0 + twi.step - 2;
+            }
+            twi.twcrOut = twi.twcr | TWCR_MARKER;
+        }
+    }
+    return &twi.twcrOut;
+}
+
+volatile uint8_t* twi_mock_twsr(void) {
+    sync();
+    return &twi.twsr;
+}
+
+volatile uint8_t* twi_mock_twdr(void) {
+    sync();
+    return &twi.twdr;
+}
+
+volatile uint8_t* twi_mock_twbr(void) {
+    sync();
+    return &twi.twbr;
+}
+
+volatile uint8_t* twi_mock_portc(void) {
+    sync();
+    return &twi.portc;
+}
+
+volatile uint8_t* twi_mock_ddrc(void) {
+    sync();
+    return &twi.ddrc;
+}
+
+volatile uint8_t* twi_mock_pinc(void) {
+    sync();
+    twi.cycles += PIN_POLL_CYCLES;
+    return &twi.pinc;
+}
+
+uint16_t my_timer_now(void) {
+    return twi.cycles / MY_TIMER_PRESCALER;
+}
+
+void _delay_us(double us) {
+    sync();
+    twi.cycles += us * F_CPU / 1000000UL;
+}
+
+void _delay_ms(double ms) {
+    _delay_us(ms * 1000);
+}
+
+/* ------------------------------------------------------------------------- */
+/* -------------------------------- scenarios ------------------------------ */
+/* ------------------------------------------------------------------------- */
+
+typedef struct {
+    const char* name;
+    uint8_t receive;        // twi_receive_data instead of twi_send_data
+    uint8_t len;
+    uint8_t failStep;
+    uint8_t answer;
+    uint8_t expected;       // return value of the driver
+} scenario_t;
+
+static const scenario_t scenarios[] = {
+    {"send",                    0, 2, 0, ANSWER_OK,       1},
+    {"send, repeated start",    0, 2, 0, ANSWER_REPSTART, 1},
+    {"send, start arb lost",    0, 2, 0, ANSWER_ARB_LOST, 0},
+    {"send, start bus error",   0, 2, 0, ANSWER_BUS_ERR,  0},
+    {"send, start stuck",       0, 2, 0, ANSWER_STUCK,    0},
+    {"send, SLA+W nack",        0, 2, 1, ANSWER_NACK,     0},
+    {"send, SLA+W arb lost",    0, 2, 1, ANSWER_ARB_LOST, 0},
+    {"send, SLA+W stuck",       0, 2, 1, ANSWER_STUCK,    0},
+    {"send, data 1 nack",       0, 2, 2, ANSWER_NACK,     0},
+    {"send, data 2 nack",       0, 2, 3, ANSWER_NACK,     0},
+    {"send, data 2 arb lost",   0, 2, 3, ANSWER_ARB_LOST, 0},
+    {"send, data 2 stuck",      0, 2, 3, ANSWER_STUCK,    0},
+    {"receive",                 1, 6, 0, ANSWER_OK,       1},
+    {"receive, start stuck",    1, 6, 0, ANSWER_STUCK,    0},
+    {"receive, SLA+R nack",     1, 6, 1, ANSWER_NACK,     0},
+    {"receive, SLA+R arb lost", 1, 6, 1, ANSWER_ARB_LOST, 0},
+    {"receive, SLA+R stuck",    1, 6, 1, ANSWER_STUCK,    0},
+    {"receive, data 1 bus err", 1, 6, 2, ANSWER_BUS_ERR,  0},
+    {"receive, data 6 bus err", 1, 6, 7, ANSWER_BUS_ERR,  0},
+    {"receive, data 6 stuck",   1, 6, 7, ANSWER_STUCK,    0},
+    {"receive, slow slave",     1, 6, 0, ANSWER_SLOW,     0},
+};
+
+#define SCENARIO_COUNT (sizeof(scenarios) / sizeof(scenarios[0]))
+
+/* bus clear scenarios */
+typedef struct {
+    const char* name;
+    uint8_t sdaHold;        // pulses until the slave lets go of SDA
+    uint8_t sclHold;
+    uint8_t expected;       // return value of twi_bus_clear()
+    uint8_t pulses;         // clock pulses while the slave holds SDA
+    uint8_t stops;
+} clear_t;
+
+static const clear_t clears[] = {
+    {"idle bus",                0, 0, 1, 0, 0},
+    {"SDA held for 1 bit",      1, 0, 1, 1, 1},
+    {"SDA held for 5 bits",     5, 0, 1, 5, 1},
+    {"SDA held for 9 bits",     9, 0, 1, 9, 1},
+    {"SDA held for good",     255, 0, 0, 10, 0},   // nine and the STOP
+    {"SCL held",                0, 1, 0, 0, 0},
+};
+
+#define CLEAR_COUNT (sizeof(clears) / sizeof(clears[0]))
+
+void __vector_twi_deferred(void);
+
+/* Polls twi_status() like the main loop and calls the interrupt handler
+ * whenever TWINT is set. Returns the final status, or TWI_BUSY if the
+ * engine never finished. */
+static uint8_t run_async(void) {
+    uint8_t status;
+
+    while ((status = twi_status()) == TWI_BUSY) {
+        uint8_t twcr = TWCR;
+
+        if (twi.cycles > 1000000ULL * TWI_XFER_TIMEOUT_US) {
+            break;
+        }
+        if ((twcr & (1<<TWINT)) && (twcr & (1<<TWIE))) {
+            __vector_twi_deferred();
+        }
+        sync();
+        if (twi.busy && !twi.stuck && twi.doneAt > twi.cycles) {
+            twi.cycles = twi.doneAt;    // the interrupt comes in right away
+        } else {
+            twi.cycles += STATUS_POLL_CYCLES;
+        }
+    }
+    sync();
+    return status;
+}
+
+/* Starts an asynchronous read on a dead bus and waits until twi_status()
+ * gives up. Returns the cycles that took, or 0 if it never did. */
+static unsigned long long async_stuck(void) {
+    uint8_t data[6];
+
+    twi_mock_reset(0, ANSWER_STUCK);
+    twi_abort();
+    twi_start_receive(0x52, data, sizeof(data), 0);
+    return (run_async() == TWI_ERROR && twi.disables) ? twi.cycles : 0;
+}
+
+/* ways to get a sample, see sample() */
+#define SAMPLE_SEPARATE     0   // request and read with a STOP each
+#define SAMPLE_STOP_START   1   // one transaction, STOP and START in between
+#define SAMPLE_REP_START    2   // one transaction, repeated START
+
+static const char* sampleNames[] = {"separate", "combined, STOP+START", "combined, rep START"};
+
+/* Sends the 0x00 request and reads six bytes. Returns 1 if the data came
+ * in, the right byte went out and the bus was free at the end. */
+static uint8_t sample(uint8_t async, uint8_t how, uint8_t* stops) {
+    uint8_t request[1] = {0x00};
+    uint8_t data[6];
+    uint8_t ok, i;
+
+    twi_mock_reset(STEP_IDLE, ANSWER_OK);
+    twi_abort();
+    memset(data, 0, sizeof(data));
+    if (async && how == SAMPLE_SEPARATE) {
+        ok = twi_start_send(0x52, request, 1, 0) && run_async() == TWI_DONE;
+        // twi_start() refuses until the STOP is out
+        while (TWCR & (1<<TWSTO));
+        ok = ok && twi_start_receive(0x52, data, sizeof(data), 0) && run_async() == TWI_DONE;
+        // the next transaction would have to wait for this STOP
+        while (TWCR & (1<<TWSTO));
+    } else if (async) {
+        ok = twi_start_send_receive(0x52, request, 1, data, sizeof(data), how == SAMPLE_REP_START, 0)
+            && run_async() == TWI_DONE;
+        while (TWCR & (1<<TWSTO));
+    } else if (how == SAMPLE_SEPARATE) {
+        ok = twi_send_data(0x52, request, 1) && twi_receive_data(0x52, data, sizeof(data));
+    } else {
+        ok = twi_send_receive_data(0x52, request, 1, data, sizeof(data), how == SAMPLE_REP_START);
+    }
+    sync();
+    for (i = 0; i < sizeof(data); i++) {
+        if (data[i] != 0xa0 + i) {
+            ok = 0;
+        }
+    }
+    *stops = twi.stops;
+    return ok && twi.sentLen == 1 && twi.sent[0] == 0x00 && !(twi.twcr & (1<<TWSTO));
+}
+
+int main(void) {
+    static const uint8_t out[6] = {0xf0, 0x55, 0xfb, 0x00, 0x40, 0x00};
+    uint8_t data[6];
+    unsigned s, failed = 0;
+    double worstUs = 0;
+    unsigned long long asyncCycles;
+
+    printf("# F_CPU %lu Hz, SCL %lu Hz, %lu polls per byte, %d cycles per poll (estimated)\n",
+        (unsigned long)F_CPU, (unsigned long)TW_SCL, (unsigned long)BYTE_POLLS, WAIT_CYCLES_PER_POLL);
+    printf("# timeouts %u us per byte, %u us per transaction, %lu us per sample\n",
+        TWI_BYTE_TIMEOUT_US, TWI_XFER_TIMEOUT_US, (unsigned long)TWI_SAMPLE_STALL_US);
+    printf("%-24s %-9s %3s %5s %5s %9s %9s %9s  %s\n",
+        "scenario", "answer", "ret", "waits", "stops", "max wait", "polls", "stall us", "check");
+
+    for (s = 0; s < SCENARIO_COUNT; s++) {
+        const scenario_t* sc = &scenarios[s];
+        const char* problem = "ok";
+        uint8_t ret;
+        double stallUs;
+
+        twi_mock_reset(sc->failStep, sc->answer);
+        memset(data, 0, sizeof(data));
+        if (sc->receive) {
+            ret = twi_receive_data(0x52, data, sc->len);
+        } else {
+            memcpy(data, out, sc->len);
+            ret = twi_send_data(0x52, data, sc->len);
+        }
+        sync();
+
+        stallUs = twi.cycles * 1e6 / F_CPU;
+        if (stallUs > worstUs) {
+            worstUs = stallUs;
+        }
+
+        if (ret != sc->expected) {
+            problem = "wrong return value";
+        } else if (!twi.stops && !twi.disables) {
+            problem = "bus not released";
+        } else if (!twi.sda || !twi.scl) {
+            problem = "bus left wedged";
+        } else if (twi.maxPolls * WAIT_CYCLES_PER_POLL > MAX_WAIT_CYCLES) {
+            problem = "byte timeout exceeded";
+        } else if (twi.cycles > MAX_XFER_CYCLES) {
+            problem = "transaction timeout exceeded";
+        } else if (ret && !sc->receive && (twi.sentLen != sc->len || memcmp(twi.sent, out, sc->len))) {
+            problem = "wrong data sent";
+        } else if (ret && sc->receive) {
+            uint8_t i;
+            for (i = 0; i < sc->len; i++) {
+                if (data[i] != 0xa0 + i) {
+                    problem = "wrong data received";
+                }
+            }
+        }
+        if (strcmp(problem, "ok")) {
+            failed++;
+        }
+
+        printf("%-24s %-9s %3u %5u %5u %9lu %9lu %9.1f  %s\n", sc->name,
+            answerNames[sc->answer], ret, twi.waits, twi.stops, twi.maxPolls, twi.polls, stallUs, problem);
+    }
+
+    asyncCycles = async_stuck();
+    if (!asyncCycles || asyncCycles > MAX_XFER_CYCLES) {
+        failed++;
+    }
+    printf("%-24s %-9s %3s %5s %5s %9s %9s %9.1f  %s\n", "async receive, stuck", answerNames[ANSWER_STUCK],
+        "-", "-", "-", "-", "-", asyncCycles * 1e6 / F_CPU, (asyncCycles && asyncCycles <= MAX_XFER_CYCLES) ? "ok" : "no timeout");
+
+    printf("\n%-24s %3s %6s %5s %9s  %s\n", "bus clear", "ret", "pulses", "stops", "time us", "check");
+    for (s = 0; s < CLEAR_COUNT; s++) {
+        const clear_t* cl = &clears[s];
+        const char* problem = "ok";
+        uint8_t ret;
+
+        twi_mock_reset(STEP_IDLE, ANSWER_OK);
+        twi.sdaHold = cl->sdaHold;
+        twi.sclHold = cl->sclHold;
+        sync();
+        ret = twi_bus_clear();
+        sync();
+
+        if (ret != cl->expected) {
+            problem = "wrong return value";
+        } else if (twi.pulses != cl->pulses) {
+            problem = "wrong number of pulses";
+        } else if (twi.pinStops != cl->stops) {
+            problem = "no STOP";
+        } else if (twi.cycles > MAX_CLEAR_CYCLES) {
+            problem = "too slow";
+        }
+        if (strcmp(problem, "ok")) {
+            failed++;
+        }
+        printf("%-24s %3u %6u %5u %9.1f  %s\n", cl->name, ret, twi.pulses, twi.pinStops, twi.cycles * 1e6 / F_CPU, problem);
+    }
+
+    printf("\n%-30s %5s %9s %9s  %s\n", "sample, bus time", "stops", "time us", "saved us", "check");
+    for (s = 0; s < 6; s++) {
+        uint8_t async = s / 3, how = s % 3, stops;
+        static double separateUs;
+        uint8_t ok = sample(async, how, &stops);
+        double us = twi.cycles * 1e6 / F_CPU;
+        char name[40];
+
+        if (how == SAMPLE_SEPARATE) {
+            separateUs = us;
+        }
+        if (!ok) {
+            failed++;
+        }
+        snprintf(name, sizeof(name), "%s, %s", async ? "async" : "blocking", sampleNames[how]);
+        printf("%-30s %5u %9.1f %9.1f  %s\n", name, stops, us, separateUs - us, ok ? "ok" : "failed");
+    }
+
+    printf("# worst stall %.1f us, %u of %u scenarios failed\n", worstUs, failed, (unsigned)(SCENARIO_COUNT + 1 + CLEAR_COUNT + 6));
+    return failed ? 1 : 0;
+}
@@ -11,26 +11,130 @@
  * License: GNU GPL v2 (see License.txt), GNU GPL v3
  */
 
-#define TW_SCL 100000// TWI frequency in Hz
+/* The bus runs at 400 kHz as long as the controller copes with it and
+ * falls back to 100 kHz when errors pile up, see busSpeedCheck(). */
+#define TW_SCL_FAST     400000  // TWI frequencies in Hz
+#define TW_SCL_STANDARD 100000
+
+/* Define USB_POLL_1MS to ask the host for a poll every millisecond. A
+ * sample then has to fit into 1 ms, so the bus stays at 400 kHz, the
+ * conversion time is shortened and the request is pipelined, unless
+ * WII_POLL_ALIGNED is given. The build fails if a sample can't make it,
+ * see WII_SAMPLE_US. */
+#ifdef USB_POLL_1MS
+#define TW_SCL TW_SCL_FAST      // slowest TWI frequency, for the checks below
+#else
+#define TW_SCL TW_SCL_STANDARD
+#define BUS_SPEED_FALLBACK
+#endif
 
 #include "twi_speed.h"
 
+#include <string.h>
 #include <avr/io.h>
 #include <avr/wdt.h>
 #include <avr/interrupt.h>  /* for sei() */
-#include <util/delay.h>     /* for _delay_ms() */
 
 #include <avr/pgmspace.h>   /* required by usbdrv.h */
+#include <avr/eeprom.h>
 #include "usbdrv.h"
 #include "oddebug.h"        /* This is also an example for using debug macros */
 
 #include "bit_tools.h"
 #include "twi_func.h"
+#include "classic_controller.h"
 
-// #include "my_timers.h"
+#include "my_timers.h"
+#include "pt.h"
 
 #define SLAVE_ADDR 0x52     /* address of classic controller and nunchuck */
 
+/* minimum time between the 0x00 request and reading the data, can be
+ * changed at runtime with VENDOR_RQ_SET_CONVERSION_US */
+#ifndef WII_CONVERSION_US
+#ifdef USB_POLL_1MS
+#define WII_CONVERSION_US 300
+#else
+#define WII_CONVERSION_US 2000
+#endif
+#endif
+
+/* Define WII_PIPELINED to send the 0x00 request for the next sample right
+ * after the current one has been decoded. The request then converts while
+ * the main loop sends the current sample. */
+
+/* Define WII_COMBINED to send the 0x00 request and read the data in one
+ * transaction with a repeated START, for controllers that tolerate it.
+ * There is no conversion time, the controller answers with the data it
+ * converted last. Add WII_COMBINED_STOP to send a STOP and a START in
+ * between instead of the repeated START. */
+#ifdef WII_COMBINED_STOP
+#define WII_REPEATED_START 0
+#else
+#define WII_REPEATED_START 1
+#endif
+
+/* Define WII_POLL_ALIGNED to take one sample per interrupt-IN poll of the
+ * host, timed to be ready WII_POLL_MARGIN_US before the next expected
+ * poll. The report is only handed to the driver when that sample is in. */
+#ifndef WII_POLL_MARGIN_US
+#define WII_POLL_MARGIN_US 500
+#endif
+
+/* A controller that feeds us 0xff has lost its init, e.g. because it was
+ * replugged. Only the controller is initialized again, an attempt every
+ * WII_RECOVER_RETRY_MS, while the USB connection stays up. Define
+ * WII_RESTART_ON_FAULT to get the old full restart with a re-enumeration
+ * instead, "make recovery" compares both. */
+#ifndef WII_RECOVER_RETRY_MS
+#define WII_RECOVER_RETRY_MS 10
+#endif
+
+#if defined(USB_POLL_1MS) && !defined(WII_POLL_ALIGNED) && !defined(WII_PIPELINED) && !defined(WII_COMBINED)
+#define WII_PIPELINED
+#endif
+
+#if defined(WII_COMBINED) && defined(WII_PIPELINED)
+#error WII_COMBINED and WII_PIPELINED can not be combined
+#endif
+
+#if defined(WII_POLL_ALIGNED) && defined(WII_PIPELINED)
+#error WII_POLL_ALIGNED and WII_PIPELINED can not be combined
+#endif
+
+/* Bus time of one sample in us: the 0x00 request (START, SLA+W, one byte,
+ * STOP), the conversion, the gap before the next START and the read
+ * (START, SLA+R, the data, STOP). WII_COMBINED has no conversion time.
+ * Every poll interval has to hold a sample plus WII_LOOP_BUDGET_US for
+ * decoding and sending it. */
+#ifdef WII_COMBINED
+#define WII_SAMPLE_US ((2UL + 9 + 9 + 2 + 9 + 9 * WII_DATA_LEN) * 1000000UL / TW_SCL + 20)
+#else
+#define WII_SAMPLE_US ((2UL + 9 + 9 + 2 + 9 + 9 * WII_DATA_LEN) * 1000000UL / TW_SCL \
+                       + WII_CONVERSION_US + 20)
+#endif
+#define WII_LOOP_BUDGET_US 200
+
+#if !TWI_TWBR_OK(TW_SCL_FAST) || !TWI_TWBR_OK(TW_SCL_STANDARD)
+#error TWI frequency is not possible with TWPS = 0
+#endif
+
+#if WII_SAMPLE_US + WII_LOOP_BUDGET_US > 1000UL * USB_CFG_INTR_POLL_INTERVAL
+#error a sample does not fit into the poll interval, shorten WII_CONVERSION_US
+#endif
+
+/* Bits of the longest transaction, it must not run into the timeout: the
+ * read, or with WII_COMBINED the request, the repeated START (or STOP and
+ * START) and the read in one. */
+#ifdef WII_COMBINED
+#define WII_XFER_BITS (2UL + 9 + 9 + 2 + 9 + 9 * WII_DATA_LEN)
+#else
+#define WII_XFER_BITS (2UL + 9 + 9 * WII_DATA_LEN)
+#endif
+#if WII_XFER_BITS * 1000000UL / TW_SCL > TWI_XFER_TIMEOUT_US
+#error a transaction takes longer than TWI_XFER_TIMEOUT_US, see twi_func.h
+#endif
+
 
 /* ------------------------------------------------------------------------- */
 /* ----------------------------- USB interface ----------------------------- */
@@ -85,51 +189,141 @@ PROGMEM char usbHidReportDescriptor[49] = {
     0xc0                           // END_COLLECTION (Application)
 };
 
-typedef struct {
-    uchar   x;
-    uchar   y;
-    // uint16_t debug;
-    uchar   Rx;
-    uchar   Ry;
-#ifdef WITH_ANALOG_L_R
-    uchar   leftTrig;
-    uchar   rightTrig;
-#endif
-    uchar   buttons[2];
-} report_t;
+uchar rawData[WII_DATA_LEN];
 
+/* The decoder writes into the back buffer, which then becomes the front
+ * buffer by a single byte write. Everything handed to the host comes from
+ * the front buffer, so it is always one complete sample. */
+static report_t reportBuffers[2];
+static uchar    reportFront;    /* index of the front buffer */
 
-uchar rawData[6];
+/* Buttons pressed in any sample since the host took the last report. They
+ * are added to the next report, so a tap shorter than a poll interval
+ * still reaches the host, and released in the one after. */
+static uchar    pressLatch[2];
 
-static report_t reportBuffer;
-static uchar    idleRate;   /* repeat rate for keyboards, never used for mice */
+/* The front report plus pressLatch, built by usbTask(). The interrupt-IN
+ * endpoint and GET_REPORT both send it, so they agree on a latched tap. */
+static report_t reportOut;
+static uchar    idleRate;   /* HID idle rate in 4 ms steps, 0: send only on change */
 // static uchar    startByte = 0;
 
-/* Calibration values for the analog sticks and triggers */
+/* Button map in the EEPROM, see classic_controller_button_map() */
+
+#define BUTTON_MAP_MAGIC 0xc2   /* marks a valid map in the EEPROM */
 
-#define INITIAL_XMAX 100
-#define INITIAL_XMIN -100
-#define INITIAL_YMAX 100
-#define INITIAL_YMIN -100
-#define INITIAL_RXMAX 100
-#define INITIAL_RXMIN -100
-#define INITIAL_RYMAX 100
-#define INITIAL_RYMIN -100
+static uchar eeButtonMapMagic EEMEM;
+static uchar eeButtonMap[BUTTON_MAP_SIZE] EEMEM;
+
+static uint16_t buttonMapDirty;     /* entries not yet written to EEPROM */
+static uchar buttonMapMagicPending; /* magic has to be written after them */
+static uchar buttonMapValid;        /* the EEPROM holds the magic */
+
+/* Loads the map from the EEPROM, or the default map if there is none */
+static void loadButtonMap(void) {
+    uchar map[BUTTON_MAP_SIZE];
+
+    buttonMapValid = (eeprom_read_byte(&eeButtonMapMagic) == BUTTON_MAP_MAGIC);
+    if (buttonMapValid) {
+        eeprom_read_block(map, eeButtonMap, sizeof(map));
+        classic_controller_load_buttons(map);
+    } else {
+        classic_controller_load_buttons(0);
+    }
+}
+
+/* Changes one entry, it is written to the EEPROM by saveButtonMap() */
+static void setButtonMap(uchar source, uchar target) {
+    if (!classic_controller_set_button(source, target)) {
+        return;
+    }
+    if (!buttonMapValid && !buttonMapMagicPending) {
+        // the whole map has to go to the EEPROM before it becomes valid
+        buttonMapDirty = 0xffff;
+        buttonMapMagicPending = 1;
+    }
+    buttonMapDirty |= 1U << source;
+}
+
+/* Writes at most one changed byte, never waits for the EEPROM */
+static void saveButtonMap(void) {
+    uchar i;
+
+    if (!eeprom_is_ready()) {
+        return;
+    }
+    for (i = 0; i < BUTTON_MAP_SIZE; i++) {
+        if (buttonMapDirty & (1U << i)) {
+            buttonMapDirty &= ~(1U << i);
+            eeprom_write_byte(&eeButtonMap[i], classic_controller_button_map()[i]);
+            return;
+        }
+    }
+    if (buttonMapMagicPending) {
+        buttonMapMagicPending = 0;
+        buttonMapValid = 1;
+        eeprom_write_byte(&eeButtonMapMagic, BUTTON_MAP_MAGIC);
+    }
+}
+
+/* Runtime statistics, the host can read them with a vendor request */
+
+#define VENDOR_RQ_GET_STATS     1   /* returns stats_t */
+#define VENDOR_RQ_CLEAR_STATS   2   /* resets all maximum values */
+#define VENDOR_RQ_SET_CONVERSION_US 3   /* wValue: conversion time in us */
+#define VENDOR_RQ_SET_CURVE     4   /* wValue: axis (low), curve (high) */
+#define VENDOR_RQ_GET_BUTTON_MAP    5   /* returns the 16 byte button map */
+#define VENDOR_RQ_SET_BUTTON    6   /* wValue: source bit (low), button (high) */
+#define VENDOR_RQ_SET_BUS_SPEED 7   /* wValue: one of BUS_SPEED_* */
 
 typedef struct {
-    signed char xMax;
-    signed char xMin;
-    signed char yMax;
-    signed char yMin;
-    signed char RxMax;
-    signed char RxMin;
-    signed char RyMax;
-    signed char RyMin;
-} calibration_t;
+    /* worst-case main loop iteration in units of 64 cycles (4us @ 16MHz),
+     * only measured when built with MEASURE_LOOP_TIME */
+    uint16_t loopMaxTicks;
+    /* decoded samples during the last second, updated every 250ms */
+    uint16_t samplesPerSecond;
+    /* time from the 0x00 request to usbSetInterrupt() in 4us ticks */
+    uint16_t dataAgeMaxTicks;
+    uint16_t dataAgeAvgTicks;   /* running average over ~8 reports */
+    /* handshake that initialized the controller, one of INIT_* */
+    uchar    initPath;
+    /* estimated interval of the interrupt-IN polls in 4us ticks */
+    uint16_t pollPeriodTicks;
+    /* time from the 0x00 request until the host took the report */
+    uint16_t pollAgeMaxTicks;
+    uint16_t pollAgeAvgTicks;   /* running average over ~8 reports */
+    uint16_t pollAgeJitterTicks;    /* average deviation from pollAgeAvg */
+    /* WII_POLL_ALIGNED only: samples that were late for their poll */
+    uint16_t pollsMissed;
+    /* controller recoveries after 0xff data, see wiiRecover() */
+    uint16_t recoveries;
+    /* time from the last fault to the first valid sample in ms, 0xffff if
+     * it took longer than WII_RECOVER_LONG_MS */
+    uint16_t recoverMs;
+    /* TWI speed in use, one of BUS_SPEED_* */
+    uchar    busSpeed;
+    /* bus time of a sample (request and read) per speed in 4us ticks,
+     * running average over ~8 samples */
+    uint16_t busTicks[2];
+    /* failed samples since the start */
+    uint16_t busErrors;
+    /* MEASURE_LOOP_TIME only: worst-case my_timer_run() in 4us ticks, and
+     * its sum over the last 250ms window, out of 62500 at 16MHz */
+    uint16_t timerMaxTicks;
+    uint16_t timerLoadTicks;
+} stats_t;
+
+static stats_t stats;
 
-static calibration_t calibration;
+/* values of stats.initPath */
+#define INIT_NONE           0   /* controller did not answer */
+#define INIT_UNENCRYPTED    1   /* 0xF0=0x55, 0xFB=0x00 */
+#define INIT_LEGACY         2   /* 0x40=0x00, data has to be decrypted */
 
 
+static void setConversionTime(uint16_t us);
+static void setBusSpeed(uchar speed);
+
 /* ------------------------------------------------------------------------- */
 
 usbMsgLen_t usbFunctionSetup(uchar data[8])
@@ -142,210 +336,737 @@ usbRequest_t    *rq = (void *)data;
     if((rq->bmRequestType & USBRQ_TYPE_MASK) == USBRQ_TYPE_CLASS){    /* class request type */
         DBG1(0x50, &rq->bRequest, 1);   /* debug output: print our request */
         if(rq->bRequest == USBRQ_HID_GET_REPORT){  /* wValue: ReportType (highbyte), ReportID (lowbyte) */
-            /* we only have one report type, so don't look at wValue */
-            usbMsgPtr = (void *)&reportBuffer;
-            return sizeof(reportBuffer);
+            /* we only have one report type, so don't look at wValue. The
+             * report fits into one packet, which usbPoll() builds before
+             * usbTask() can compose the next one. */
+            usbMsgPtr = (void *)&reportOut;
+            return sizeof(report_t);
         }else if(rq->bRequest == USBRQ_HID_GET_IDLE){
             usbMsgPtr = &idleRate;
             return 1;
         }else if(rq->bRequest == USBRQ_HID_SET_IDLE){
             idleRate = rq->wValue.bytes[1];
         }
-    }else{
-        /* no vendor specific requests implemented */
+    }else if((rq->bmRequestType & USBRQ_TYPE_MASK) == USBRQ_TYPE_VENDOR){
+        if(rq->bRequest == VENDOR_RQ_GET_STATS){
+            usbMsgPtr = (void *)&stats;
+            return sizeof(stats);
+        }else if(rq->bRequest == VENDOR_RQ_CLEAR_STATS){
+            stats.loopMaxTicks = 0;
+            stats.timerMaxTicks = 0;
+            stats.dataAgeMaxTicks = 0;
+            stats.pollAgeMaxTicks = 0;
+            stats.pollsMissed = 0;
+        }else if(rq->bRequest == VENDOR_RQ_SET_CONVERSION_US){
+            setConversionTime(rq->wValue.word);
+        }else if(rq->bRequest == VENDOR_RQ_SET_CURVE){
+            classic_controller_set_curve(rq->wValue.bytes[0], rq->wValue.bytes[1]);
+        }else if(rq->bRequest == VENDOR_RQ_GET_BUTTON_MAP){
+            usbMsgPtr = (void *)classic_controller_button_map();
+            return BUTTON_MAP_SIZE;
+        }else if(rq->bRequest == VENDOR_RQ_SET_BUTTON){
+            setButtonMap(rq->wValue.bytes[0], rq->wValue.bytes[1]);
+        }else if(rq->bRequest == VENDOR_RQ_SET_BUS_SPEED){
+            setBusSpeed(rq->wValue.bytes[0]);
+        }
     }
     return 0;   /* default for not implemented requests: return no data back to host */
 }
 
 /* ------------------------------------------------------------------------- */
 
+/* steps of the acquisition, see fillReportWithWii() */
+#define WII_REQUEST     0   /* send 0x00 to the controller */
+#define WII_CONVERT     1   /* request is being sent or converted */
+#define WII_START_READ  2   /* the timer found the bus busy, retry */
+#define WII_READ        3   /* wait until the 6 bytes have been received */
+
+/* return values of fillReportWithWii() */
+#define WII_ERROR       0
+#define WII_NEW_DATA    1
+#define WII_PENDING     2
+#define WII_FAULT       3   /* a sample of nothing but 0xff */
+
+static volatile uchar wiiState = WII_REQUEST;
+static uchar wiiRequest[1] = {0x00};
+static uchar wiiBuf[WII_DATA_LEN];  /* filled by the TWI interrupt */
+static uchar wiiEncrypted;          /* set by the legacy handshake */
+static uint16_t wiiConversionTicks = MY_TIMER_US(WII_CONVERSION_US);
+
+/* bus time of the last request and of the sample in wiiBuf */
+static uint16_t wiiRequestBusTicks;
+static uint16_t wiiSampleBusTicks;
+
+/* time stamps for measuring the data age, see stats_t */
+static uint16_t wiiRequestTime;     /* last 0x00 request went out */
+static uint16_t wiiSampleTime;      /* request time of the sample in wiiBuf */
+static uint16_t reportRequestTime;  /* request time of the front report */
+
+#ifdef WII_POLL_ALIGNED
+static uchar wiiSampleDue = 1;      /* the next sample may be started */
+static uint16_t wiiStartTime;       /* the current sample was started */
+static uint16_t wiiAcquireTicks;    /* time a sample takes, biased up */
+static uint16_t wiiStartOffset;     /* start of the sample after a poll */
+#endif
+
+#ifdef WII_PIPELINED
+static volatile uchar wiiSampleReady;
+
+static void wiiReadDone(uchar status);
+#define WII_READ_DONE_CALLBACK wiiReadDone
+#else
+#define WII_READ_DONE_CALLBACK 0
+#endif
+
+static void setConversionTime(uint16_t us) {
+    uint16_t ticks = MY_TIMER_US((uint32_t)us);
+
+    // a oneshot of 0 ticks would only fire after the timer wrapped
+    wiiConversionTicks = ticks ? ticks : 1;
+}
+
+/* called by the timer when the conversion time has passed */
+static void wiiStartRead(void* ptr) {
+    // ------ now get 6 bytes of data
+    if (twi_start_receive(SLAVE_ADDR, wiiBuf, WII_DATA_LEN, WII_READ_DONE_CALLBACK)) {
+        wiiState = WII_READ;
+    } else {
+        wiiState = WII_START_READ;  // let the main loop retry
+    }
+}
+
+#ifndef WII_COMBINED
+/* called by the TWI interrupt when the 0x00 request is out */
+static void wiiRequestSent(uchar status) {
+    if (status == TWI_DONE) {
+        wiiRequestTime = my_timer_now();
+        wiiRequestBusTicks = twi_duration();
+        my_timer_oneshot(wiiConversionTicks, wiiStartRead, 0);
+    }
+}
+#endif
+
+#ifdef WII_PIPELINED
+/* armed by fillReportWithWii(), runs when the STOP of the read is through */
+static void wiiSendRequest(void* ptr) {
+    if (twi_start_send(SLAVE_ADDR, wiiRequest, 1, wiiRequestSent)) {
+        wiiState = WII_CONVERT;
+    } else {
+        wiiState = WII_REQUEST;     // let the main loop retry
+    }
+}
+
+/* called by the TWI interrupt when the 6 bytes are in */
+static void wiiReadDone(uchar status) {
+    if (status == TWI_DONE) {
+        wiiSampleTime = wiiRequestTime;
+        wiiSampleBusTicks = wiiRequestBusTicks + twi_duration();
+        wiiSampleReady = 1;
+    }
+}
+#endif
+
+/* TWI speed, see busSpeedCheck() */
+
+#define BUS_SPEED_STANDARD  0   /* TW_SCL_STANDARD */
+#define BUS_SPEED_FAST      1   /* TW_SCL_FAST */
+
+#define BUS_WINDOW      64      /* samples per error rate window */
+#define BUS_MAX_ERRORS  8       /* failed samples that make 400 kHz fail */
+
+static uchar eeBusSpeed EEMEM;  /* working speed, erased (0xff) tries 400 kHz */
+static uchar busSpeed = BUS_SPEED_FAST;
+static uchar busSpeedSaved;     /* what the EEPROM holds */
+static uchar busSpeedDirty;     /* busSpeed has to go to the EEPROM */
+static uchar busWindowCount;    /* samples in the current window */
+static uchar busWindowErrors;   /* failed ones among them */
+
+/* Loads the speed that worked last time */
+static void loadBusSpeed(void) {
+#ifdef BUS_SPEED_FALLBACK
+    busSpeedSaved = eeprom_read_byte(&eeBusSpeed);
+    busSpeed = (busSpeedSaved == BUS_SPEED_STANDARD) ? BUS_SPEED_STANDARD : BUS_SPEED_FAST;
+#endif
+    stats.busSpeed = busSpeed;
+}
+
+/* Writes the speed, never waits for the EEPROM */
+static void saveBusSpeed(void) {
+    if (eeprom_is_ready()) {
+        busSpeedDirty = 0;
+        busSpeedSaved = busSpeed;
+        eeprom_write_byte(&eeBusSpeed, busSpeed);
+    }
+}
+
 /* I2C initialization */
 void myI2CInit(void) {
-    twi_init(); // this is a macro from "twi_speed.h"
+    my_timer_abort();
+    twi_abort();    // forget about any transaction from before a restart
+    twi_bus_clear();    // a controller unplugged mid-transfer may hold SDA
+    wiiState = WII_REQUEST;
+#ifdef WII_PIPELINED
+    wiiSampleReady = 0;
+#endif
+#ifdef WII_POLL_ALIGNED
+    wiiSampleDue = 1;
+#endif
+    twi_init_twbr(busSpeed == BUS_SPEED_FAST ? TWI_TWBR(TW_SCL_FAST) : TWI_TWBR(TW_SCL_STANDARD));
 }
 
-// initialize Wii controller
-unsigned char myWiiInit(void) {
-    unsigned char buf[2] = {0x40, 0x00};
+/*
+ * Switches the bus to the given speed. The acquisition starts over, as a
+ * transaction may be running. The speed is remembered in the EEPROM.
+ */
+static void setBusSpeed(uchar speed) {
+#ifdef BUS_SPEED_FALLBACK
+    if (speed > BUS_SPEED_FAST) {
+        return;
+    }
+    busSpeed = speed;
+    stats.busSpeed = speed;
+    busSpeedDirty = 1;
+    busWindowCount = busWindowErrors = 0;
+    myI2CInit();
+#endif
+}
+
+/*
+ * Called for every finished sample. Once a window of BUS_WINDOW samples
+ * is full, the error rate decides: at 400 kHz BUS_MAX_ERRORS failures
+ * drop the bus to 100 kHz. A controller that doesn't answer at all says
+ * nothing about the speed, so a window needs as many good samples too.
+ * A clean window at a speed that isn't in the EEPROM yet stores it.
+ */
+static void busSpeedCheck(uchar ok) {
+    if (!ok) {
+        stats.busErrors++;
+        busWindowErrors++;
+    }
+    if (++busWindowCount < BUS_WINDOW) {
+        return;
+    }
+#ifdef BUS_SPEED_FALLBACK
+    if ((busSpeed == BUS_SPEED_FAST) && (busWindowErrors >= BUS_MAX_ERRORS)
+            && (busWindowCount - busWindowErrors >= BUS_MAX_ERRORS)) {
+        setBusSpeed(BUS_SPEED_STANDARD);
+        return;
+    }
+    if (!busWindowErrors && (busSpeedSaved != busSpeed)) {
+        busSpeedDirty = 1;
+    }
+#endif
+    busWindowCount = busWindowErrors = 0;
+}
+
+/* Writes one register of the controller */
+static uchar wiiWriteRegister(uchar reg, uchar value) {
+    uchar buf[2];
 
+    buf[0] = reg;
+    buf[1] = value;
     return twi_send_data(SLAVE_ADDR, buf, 2);
 }
 
+/* the controller wants a millisecond between two writes, a sleep of two
+ * ticks makes sure a whole one has passed */
+#define WII_INIT_GAP_MS 2
 
-unsigned char fillReportWithWii(void) {
-    uchar i;
-    unsigned char buf[6];
+/*
+ * Task that initializes the Wii controller. The unencrypted handshake is
+ * tried first, it is also the only one some third party controllers know.
+ * If it fails we fall back to the old one, which makes the controller
+ * encrypt its data. The outcome, one of the INIT_* values, is left in
+ * stats.initPath.
+ */
+static uchar wiiInitTask(pt_t* pt) {
+    static uchar path;
 
-    /* send 0x00 to the controller to tell him we want data! */
-    buf[0] = 0x00;
-    
-    if (!twi_send_data(SLAVE_ADDR, buf, 1)) {
-        goto fend;
+    PT_BEGIN(pt);
+    path = INIT_NONE;
+    if (wiiWriteRegister(0xf0, 0x55)) {
+        PT_SLEEP(pt, WII_INIT_GAP_MS);
+        if (wiiWriteRegister(0xfb, 0x00)) {
+            path = INIT_UNENCRYPTED;
+        }
+    }
+    if (path == INIT_NONE) {
+        PT_SLEEP(pt, WII_INIT_GAP_MS);
+        if (wiiWriteRegister(0x40, 0x00)) {
+            path = INIT_LEGACY;
+        }
     }
+    wiiEncrypted = (path == INIT_LEGACY);
 
-    _delay_ms(2);
-    // _delay_us(100);
+#ifdef WII_HIRES
+    if (path != INIT_NONE) {
+        PT_SLEEP(pt, WII_INIT_GAP_MS);
+        // select data format 3
+        if (!wiiWriteRegister(0xfe, 0x03)) {
+            path = INIT_NONE;
+        }
+    }
+#endif
+    stats.initPath = path;
+    PT_END(pt);
+}
 
-    // ------ now get 6 bytes of data
-    
-    if (!(twi_receive_data(SLAVE_ADDR, buf, 6))) {
-        goto fend;
-    }
-
-    // for (i = 0; i < 6; i++) {
-    for (i = 0; i < 6; i++) {
-        rawData[i] = (buf[i] ^ 0x17) + 0x17; // decrypt data
-    }
-
-    // _delay_ms(1);
-    
-    // 128 is center ??
-    
-    // FIXME: Do this calibration stuff with less duplicate code...
-    //        Maybe don't use float math, its slow and big
-    
-    // calculation for x-axis
-    signed char x = (((rawData[0] & 0x3F))<<2) - 128;
-    if (x > calibration.xMax) calibration.xMax = x;
-    if (x < calibration.xMin) calibration.xMin = x;
-    
-    if (x > 0) {
-        reportBuffer.x = x * (127.0 / calibration.xMax) + 128;
-    } else {
-        reportBuffer.x = x * (128.0 / (-calibration.xMin)) + 128;
-    }
-    
-    // calculation for y-axis
-    signed char y = 0xff - (((rawData[1] & 0x3F))<<2) - 128;
-    if (y > calibration.yMax) calibration.yMax = y;
-    if (y < calibration.yMin) calibration.yMin = y;
-    
-    if (y > 0) {
-        reportBuffer.y = y * (127.0 / calibration.yMax) + 128;
-    } else {
-        reportBuffer.y = y * (128.0 / (-calibration.yMin)) + 128;
-    }
-    
-    // calculation for Rx-axis
-    signed char Rx = (((((rawData[0] & 0xC0) >> 3) | ((rawData[1] & 0xC0) >> 5) | ((rawData[2] & 0x80) >> 7))) << 3) - 128;
-    if (Rx > calibration.RxMax) calibration.RxMax = Rx;
-    if (Rx < calibration.RxMin) calibration.RxMin = Rx;
-    
-    if (Rx > 0) {
-        reportBuffer.Rx = Rx * (127.0 / calibration.RxMax) + 128;
+
+/* Controller recovery, see wiiRecover() */
+
+#define WII_RECOVER_LONG_MS 60000   /* recoverMs would wrap soon after */
+
+static uchar wiiRecovering;         /* the controller has to be initialized */
+static uchar wiiFaultPending;       /* no valid sample since the fault */
+static uchar wiiFaultLong;          /* the fault lasts WII_RECOVER_LONG_MS */
+static uint16_t wiiFaultTime;       /* first 0xff sample, my_timer_ms() */
+
+#ifdef WII_RESTART_ON_FAULT
+static uchar wiiRestart;            /* main() has to start over */
+#else
+/* Called when the controller sent nothing but 0xff */
+static void wiiFault(void) {
+    if (!wiiFaultPending) {
+        // a fault right after a recovery still counts from the first one
+        wiiFaultPending = 1;
+        wiiFaultLong = 0;
+        wiiFaultTime = my_timer_ms();
+    }
+    wiiRecovering = 1;
+}
+#endif
+
+/* Called for every valid sample, completes the recovery statistics */
+static void wiiSampleValid(void) {
+    if (wiiFaultPending) {
+        wiiFaultPending = 0;
+        stats.recoveries++;
+        stats.recoverMs = wiiFaultLong ? 0xffff : my_timer_ms() - wiiFaultTime;
+    }
+}
+
+static pt_t wiiInitPt;
+
+/*
+ * Task that runs instead of the acquisition until the controller has been
+ * initialized, after power-up and after a fault. Resets the TWI and
+ * initializes the extension, every WII_RECOVER_RETRY_MS until it answers.
+ * The button map stays, the calibration starts over as the controller may
+ * be a different one.
+ */
+static uchar wiiRecoverTask(pt_t* pt) {
+    PT_BEGIN(pt);
+    for (;;) {
+        if ((uint16_t)(my_timer_ms() - wiiFaultTime) >= WII_RECOVER_LONG_MS) {
+            wiiFaultLong = 1;
+        }
+        myI2CInit();
+        PT_SPAWN(pt, &wiiInitPt, wiiInitTask(&wiiInitPt));
+        if (stats.initPath != INIT_NONE) {
+            break;
+        }
+        PT_SLEEP(pt, WII_RECOVER_RETRY_MS);
+    }
+    classic_controller_recalibrate();
+    PT_END(pt);
+}
+
+/* Decrypts if needed and decodes the sample in wiiBuf, returns 0 if the
+ * controller sent nothing but 0xff, see classic_controller_fill_report() */
+static uchar wiiTakeSample(void) {
+    uchar i;
+
+    if (wiiEncrypted) {
+        for (i = 0; i < WII_DATA_LEN; i++) {
+            rawData[i] = (wiiBuf[i] ^ 0x17) + 0x17; // decrypt data
+        }
     } else {
-        reportBuffer.Rx = Rx * (128.0 / (-calibration.RxMin)) + 128;
-    }
-   
-    // calculation for Ry-axis
-    signed char Ry = (0xff - ((((rawData[2] & 0x1F))) << 3)) - 128;
-    if (Ry > calibration.RyMax) calibration.RyMax = Ry;
-    if (Ry < calibration.RyMin) calibration.RyMin = Ry;
-    
-    if (Ry > 0) {
-        reportBuffer.Ry = Ry * (127.0 / calibration.RyMax) + 128;
+        memcpy(rawData, wiiBuf, WII_DATA_LEN);
+    }
+    // a sample of 0xff bytes doesn't make it to the front, see wiiAcquire()
+    if (!classic_controller_fill_report(&reportBuffers[reportFront ^ 1], rawData)) {
+        return 0;
+    }
+    reportFront ^= 1;
+    reportRequestTime = wiiSampleTime;
+    pressLatch[0] |= reportBuffers[reportFront].buttons[0];
+    pressLatch[1] |= reportBuffers[reportFront].buttons[1];
+    return 1;
+}
+
+/* Host poll tracking, see hostPollSeen() */
+
+static uint16_t hostPollTime;       /* last poll, seen or expected */
+static uint16_t queuedRequestTime;  /* request time of the queued report */
+
+#ifdef WII_POLL_ALIGNED
+/* Rises at once when a sample takes longer, decays slowly otherwise */
+static void wiiAdaptAcquireTime(uint16_t ticks) {
+    if (ticks > wiiAcquireTicks) {
+        wiiAcquireTicks = ticks;
     } else {
-        reportBuffer.Ry = Ry * (128.0 / (-calibration.RyMin)) + 128;
+        wiiAcquireTicks -= (wiiAcquireTicks - ticks) / 16;
     }
-    
-#ifdef WITH_ANALOG_L_R
-    reportBuffer.leftTrig = (((rawData[2] & 0x60) >> 2) | ((rawData[3] & 0xE0) >> 5)) << 3;
-    reportBuffer.rightTrig = (rawData[3] & 0x1F) << 3;
-#else
-    // reportBuffer.leftTrig = (1<<7);
-    // reportBuffer.rightTrig = (1<<7);
-#endif
-
-    // reportBuffer.buttons1 = ~rawData[4];
-    // reportBuffer.buttons2 = ~rawData[5];
-
-    // split out buttons
-    #define BTN_rT      GET_BIT(~rawData[4], 1)
-    #define BTN_start   GET_BIT(~rawData[4], 2)
-    #define BTN_home    GET_BIT(~rawData[4], 3)
-    #define BTN_select  GET_BIT(~rawData[4], 4)
-    #define BTN_lT      GET_BIT(~rawData[4], 5)
-    #define BTN_down    GET_BIT(~rawData[4], 6)
-    #define BTN_right   GET_BIT(~rawData[4], 7)
-    #define BTN_up      GET_BIT(~rawData[5], 0)
-    #define BTN_left    GET_BIT(~rawData[5], 1)
-    #define BTN_rZ      GET_BIT(~rawData[5], 2)
-    #define BTN_x       GET_BIT(~rawData[5], 3)
-    #define BTN_a       GET_BIT(~rawData[5], 4)
-    #define BTN_y       GET_BIT(~rawData[5], 5)
-    #define BTN_b       GET_BIT(~rawData[5], 6)
-    #define BTN_lZ      GET_BIT(~rawData[5], 7)
-
-    // button mappings (button 0..15)
-    #define BUTTON_X              0
-    #define BUTTON_A              1
-    #define BUTTON_B              2
-    #define BUTTON_Y              3
-    #define BUTTON_START          4
-    #define BUTTON_SELECT         5
-    #define BUTTON_HOME           6
-    #define BUTTON_RIGHT_TRIGGER  7
-    #define BUTTON_LEFT_TRIGGER   8
-    #define BUTTON_RIGHT_Z        9
-    #define BUTTON_LEFT_Z        10
-    #define BUTTON_UP            11
-    #define BUTTON_DOWN          12
-    #define BUTTON_LEFT          13
-    #define BUTTON_RIGHT         14
-    #define NO_BUTTON            15
-
-    #define SET_BUTTON(BUTTON, SOURCE) SET_BIT_VALUE(reportBuffer.buttons[BUTTON/8],BUTTON%8,SOURCE)
-
-    SET_BUTTON(BUTTON_X, BTN_x);
-    SET_BUTTON(BUTTON_A, BTN_a);
-    SET_BUTTON(BUTTON_B, BTN_b);
-    SET_BUTTON(BUTTON_Y, BTN_y);
-    SET_BUTTON(BUTTON_START, BTN_start);
-    SET_BUTTON(BUTTON_SELECT, BTN_select);
-    SET_BUTTON(BUTTON_HOME, BTN_home);
-    SET_BUTTON(BUTTON_RIGHT_TRIGGER, BTN_rT);
-    SET_BUTTON(BUTTON_LEFT_TRIGGER, BTN_lT);
-    SET_BUTTON(BUTTON_RIGHT_Z, BTN_rZ);
-    SET_BUTTON(BUTTON_LEFT_Z, BTN_lZ);
-    SET_BUTTON(BUTTON_UP, BTN_up);
-    SET_BUTTON(BUTTON_DOWN, BTN_down);
-    SET_BUTTON(BUTTON_LEFT, BTN_left);
-    SET_BUTTON(BUTTON_RIGHT, BTN_right);
-    SET_BUTTON(NO_BUTTON, 0);
+}
+#endif
 
-    return 1;
+/*
+ * Called by the main loop when it finds the interrupt endpoint ready again
+ * after a report was queued, i.e. the host has just polled it. Estimates
+ * the poll period and, with WII_POLL_ALIGNED, schedules the next sample.
+ */
+static void hostPollSeen(void) {
+    uint16_t now = my_timer_now();
+    uint16_t period = now - hostPollTime;
+    uint16_t age = now - queuedRequestTime;
+    int16_t deviation;
 
-    fend:
-    // TWCR = (1<<TWINT)|(1<<TWEN)|(1<<TWSTO);
-    _delay_us(20);
+    // a longer gap means polls without a report, it says nothing about the period
+    if (period < stats.pollPeriodTicks + stats.pollPeriodTicks / 2) {
+        stats.pollPeriodTicks += ((int16_t)(period - stats.pollPeriodTicks)) / 8;
+    }
+    hostPollTime = now;
 
+    if (age > stats.pollAgeMaxTicks) {
+        stats.pollAgeMaxTicks = age;
+    }
+    deviation = age - stats.pollAgeAvgTicks;
+    stats.pollAgeAvgTicks += deviation / 8;
+    if (deviation < 0) {
+        deviation = -deviation;
+    }
+    stats.pollAgeJitterTicks += ((int16_t)(deviation - stats.pollAgeJitterTicks)) / 8;
 
-    all_fine:
-    
-    twi_stop();
-    return 0;
+#ifdef WII_POLL_ALIGNED
+    {
+        uint16_t lead = wiiAcquireTicks + MY_TIMER_US(WII_POLL_MARGIN_US);
+
+        // if a sample doesn't fit into a period just take it right away
+        wiiStartOffset = (stats.pollPeriodTicks > lead) ? stats.pollPeriodTicks - lead : 0;
+        wiiSampleDue = 1;
+    }
+#endif
 }
 
+#ifdef WII_POLL_ALIGNED
+/*
+ * Called when the sample for the next poll is in. If it came too late
+ * the poll has passed already. If the report didn't change nothing is
+ * sent, so the poll is assumed to take place as expected to schedule the
+ * sample after it. hostPollTime may then lie ahead of the timer, so it is
+ * only compared with signed differences.
+ */
+static void hostPollSample(uchar send) {
+    if ((int16_t)(my_timer_now() - hostPollTime) > (int16_t)stats.pollPeriodTicks) {
+        stats.pollsMissed++;
+    }
+    if (!send) {
+        hostPollTime += stats.pollPeriodTicks;
+        wiiSampleDue = 1;
+    }
+}
+#endif
+
+/*
+ * Advances the acquisition by one step. The bus transfers run in the TWI
+ * interrupt and the read is started by timer1 once the conversion time
+ * has passed, so this never waits for the controller and the main loop
+ * keeps calling usbPoll() in the meantime.
+ */
+unsigned char fillReportWithWii(void) {
+    uchar state;
+    uchar status;
+    uchar valid;
+
+#ifdef WII_PIPELINED
+    if (wiiSampleReady) {
+        // nothing is read into wiiBuf until the next request is out
+        wiiSampleReady = 0;
+        valid = wiiTakeSample();
+        // the request must not start before the STOP of the read is sent
+        my_timer_oneshot(MY_TIMER_US(20), wiiSendRequest, 0);
+        return valid ? WII_NEW_DATA : WII_FAULT;
+    }
+#endif
+
+    // read the state first, the interrupts may move it from CONVERT to READ
+    state = wiiState;
+    status = twi_status();
+
+    if (status == TWI_BUSY) {
+        return WII_PENDING;
+    }
 
-/* This function sets up stuff */
+    switch (state) {
+        case WII_REQUEST:
+#ifdef WII_POLL_ALIGNED
+            // signed, the expected poll may not have come yet, see hostPollSample()
+            if (!wiiSampleDue || (int16_t)(my_timer_now() - hostPollTime) < (int16_t)wiiStartOffset) {
+                return WII_PENDING;
+            }
+#endif
+#ifdef WII_COMBINED
+            /* ask for the data and read it in the same transaction */
+            if (twi_start_send_receive(SLAVE_ADDR, wiiRequest, 1, wiiBuf, WII_DATA_LEN, WII_REPEATED_START, 0)) {
+                wiiState = WII_READ;
+                wiiRequestTime = my_timer_now();
+#else
+            /* send 0x00 to the controller to tell him we want data! */
+            if (twi_start_send(SLAVE_ADDR, wiiRequest, 1, wiiRequestSent)) {
+                wiiState = WII_CONVERT;
+#endif
+#ifdef WII_POLL_ALIGNED
+                wiiSampleDue = 0;
+                wiiStartTime = my_timer_now();
+#endif
+            }
+            return WII_PENDING;
+
+        case WII_CONVERT:
+            if (status != TWI_DONE) {
+                break;
+            }
+            // the timer will start the read
+            return WII_PENDING;
+
+        case WII_START_READ:
+            wiiStartRead(0);
+            return WII_PENDING;
+
+        case WII_READ:
+            if (status != TWI_DONE) {
+                break;
+            }
+#ifdef WII_PIPELINED
+            // wiiReadDone() has taken care of it
+            return WII_PENDING;
+#else
+            wiiSampleTime = wiiRequestTime;
+            wiiSampleBusTicks = wiiRequestBusTicks + twi_duration();
+            valid = wiiTakeSample();
+            wiiState = WII_REQUEST;
+#ifdef WII_POLL_ALIGNED
+            wiiAdaptAcquireTime((uint16_t)(my_timer_now() - wiiStartTime));
+#endif
+            return valid ? WII_NEW_DATA : WII_FAULT;
+#endif
+    }
+
+    // the engine has already sent a stop, just start over
+    wiiState = WII_REQUEST;
+#ifdef WII_POLL_ALIGNED
+    wiiSampleDue = 1;
+#endif
+    return WII_ERROR;
+}
+
+/* This function sets up stuff, the controller is initialized by wiiTask() */
 void myInit(void) {
-    // initialize calibration values
-    calibration.xMax = INITIAL_XMAX;
-    calibration.xMin = INITIAL_XMIN;
-    calibration.yMax = INITIAL_YMAX;
-    calibration.yMin = INITIAL_YMIN;
-    calibration.RxMax = INITIAL_RXMAX;
-    calibration.RxMin = INITIAL_RXMIN;
-    calibration.RyMax = INITIAL_RYMAX;
-    calibration.RyMin = INITIAL_RYMIN;
-    
-    _delay_ms(300);
-    // SET_BIT(PORTC,0);
+    uchar i;
+
+    // the host may ask for a report during the power-up of the controller,
+    // it gets centered sticks until the first sample is in
+    memset(reportBuffers, 0, sizeof(reportBuffers));
+    for (i = 0; i < 2; i++) {
+        reportBuffers[i].x = reportBuffers[i].y = 128;
+        reportBuffers[i].Rx = reportBuffers[i].Ry = 128;
+    }
+    classic_controller_init();
+    loadButtonMap();
+    loadBusSpeed();
+}
+
+
+/* ------------------------------------------------------------------------- */
+/* --------------------------------- tasks --------------------------------- */
+/* ------------------------------------------------------------------------- */
+
+/*
+ * The main loop is a cooperative scheduler. It runs the software timers
+ * of my_timers.h and then gives every task a turn. A task returns as soon
+ * as it would have to wait, see pt.h, so nothing holds up usbPoll().
+ */
+
+#define LED_BLINK_MS    100     /* while the controller is initialized */
+
+static pt_t wiiPt, wiiRecoverPt, usbPt, ledPt;
+
+static uint16_t sampleCount;    /* decoded samples in the current window */
+static uchar newSample;         /* the front report has been updated */
+static uchar ledOn;             /* the last sample went well */
+static uchar idleCount;         /* 4 ms steps since the last report */
+static my_timer_t idleTimer;
+static my_timer_t sampleWindowTimer;
+#ifdef MEASURE_LOOP_TIME
+static uint16_t timerLoad;      /* time in my_timer_run() in this window */
+#endif
+
+/* Runs one step of the acquisition and books its outcome */
+static void wiiAcquire(void) {
+    uchar result = fillReportWithWii();
+
+    switch (result) {
+        case WII_NEW_DATA:
+        case WII_FAULT:
+            ledOn = 1;
+            sampleCount++;
+            newSample = 1;
+
+            /* If the gamepad starts feeding us 0xff, we have to initialize it again */
+            if (result == WII_FAULT) {
+#ifdef WII_RESTART_ON_FAULT
+                wiiRestart = 1;
+                return;
+#else
+                ledOn = 0;
+                wiiFault();
+#endif
+            } else {
+                wiiSampleValid();
+            }
+            stats.busTicks[busSpeed] += ((int16_t)(wiiSampleBusTicks - stats.busTicks[busSpeed])) / 8;
+            busSpeedCheck(1);
+            break;
+        case WII_ERROR:
+            ledOn = 0;
+            busSpeedCheck(0);
+            break;
+    }
+}
+
+/*
+ * Task of the controller: gives it time to power up, initializes it and
+ * takes one acquisition step per turn. A controller that feeds us 0xff
+ * is initialized again, see wiiRecoverTask().
+ */
+static uchar wiiTask(pt_t* pt) {
+    PT_BEGIN(pt);
+    wiiRecovering = 1;      // not initialized yet
+    PT_SLEEP(pt, 300);
     myI2CInit();
-    _delay_ms(120);
-    myWiiInit();
-    _delay_ms(1);
-    fillReportWithWii();
+    PT_SLEEP(pt, 120);
+    for (;;) {
+        if (wiiRecovering) {
+            PT_SPAWN(pt, &wiiRecoverPt, wiiRecoverTask(&wiiRecoverPt));
+            wiiRecovering = 0;
+            // the first request also waits for the last write
+            PT_SLEEP(pt, WII_INIT_GAP_MS);
+        }
+        wiiAcquire();
+        PT_YIELD(pt);
+    }
+    PT_END(pt);
+}
+
+/* HID idle rate, counted in 4 ms steps */
+static void idleTick(void* ptr) {
+    if (idleCount < 255) {
+        idleCount++;
+    }
+    my_timer_start(&idleTimer, 4, idleTick, 0);
+}
+
+/* Samples per second, counted in windows of 250 ms */
+static void sampleWindowTick(void* ptr) {
+    stats.samplesPerSecond = sampleCount * 4;
+    sampleCount = 0;
+#ifdef MEASURE_LOOP_TIME
+    stats.timerLoadTicks = timerLoad;
+    timerLoad = 0;
+#endif
+    my_timer_start(&sampleWindowTimer, 250, sampleWindowTick, 0);
+}
+
+/*
+ * Task of the USB side: serves the driver, writes the EEPROM and hands
+ * new reports to the host. It never waits.
+ */
+static uchar usbTask(pt_t* pt) {
+    static uchar reportQueued;      /* usbSetInterrupt() was called since the last poll */
+    static uchar compose;           /* reportOut has to be built again */
+    static report_t reportSent;     /* last report handed to the driver */
+    uchar changed;
+    uint16_t dataAge;
+
+    PT_BEGIN(pt);
+    stats.pollPeriodTicks = MY_TIMER_MS(USB_CFG_INTR_POLL_INTERVAL);
+    reportQueued = 0;
+    compose = 0;
+    pressLatch[0] = pressLatch[1] = 0;
+    memcpy(&reportOut, &reportBuffers[reportFront], sizeof(report_t));
+    memset(&reportSent, 0, sizeof(reportSent));
+    idleCount = 0;
+    my_timer_start(&idleTimer, 4, idleTick, 0);
+    sampleCount = 0;
+    my_timer_start(&sampleWindowTimer, 250, sampleWindowTick, 0);
+
+    for (;;) {
+        usbPoll();
+        if (buttonMapDirty || buttonMapMagicPending) {
+            saveButtonMap();
+        } else if (busSpeedDirty) {
+            saveBusSpeed();
+        }
+        if(usbInterruptIsReady() && reportQueued){
+            /* the host has just taken the last report */
+            reportQueued = 0;
+            hostPollSeen();
+            /* the presses are out, the next report may release them */
+            if (pressLatch[0] | pressLatch[1]) {
+                pressLatch[0] = pressLatch[1] = 0;
+                compose = 1;
+            }
+        }
+
+        /* A changed report is sent at once, it replaces one that is still
+         * waiting for the host. An unchanged one is only repeated when the
+         * idle rate has passed, an idle rate of 0 means never. */
+        changed = 0;
+        if (newSample || compose) {
+            memcpy(&reportOut, &reportBuffers[reportFront], sizeof(report_t));
+            reportOut.buttons[0] |= pressLatch[0];
+            reportOut.buttons[1] |= pressLatch[1];
+            changed = memcmp(&reportOut, &reportSent, sizeof(report_t));
+        }
+#ifdef WII_POLL_ALIGNED
+        if (newSample) {
+            hostPollSample(changed);
+        }
+#endif
+        newSample = 0;
+        compose = 0;
+        if(changed || (usbInterruptIsReady() && idleRate && idleCount >= idleRate)){
+            DBG1(0x03, 0, 0);   /* debug output: interrupt report prepared */
+            usbSetInterrupt((void *)&reportOut, sizeof(report_t));
+            memcpy(&reportSent, &reportOut, sizeof(report_t));
+            idleCount = 0;
+            reportQueued = 1;
+            queuedRequestTime = reportRequestTime;
+            dataAge = my_timer_now() - reportRequestTime;
+            if (dataAge > stats.dataAgeMaxTicks) {
+                stats.dataAgeMaxTicks = dataAge;
+            }
+            stats.dataAgeAvgTicks += ((int16_t)(dataAge - stats.dataAgeAvgTicks)) / 8;
+        }
+        PT_YIELD(pt);
+    }
+    PT_END(pt);
+}
+
+/* Task of the status LED on PC0: blinks while the controller is being
+ * initialized, else it is lit as long as the samples come in */
+static uchar ledTask(pt_t* pt) {
+    PT_BEGIN(pt);
+    for (;;) {
+        if (wiiRecovering) {
+            TOGGLE_BIT(PORTC, 0);
+            PT_SLEEP(pt, LED_BLINK_MS);
+        } else {
+            SET_BIT_VALUE(PORTC, 0, ledOn);
+            PT_YIELD(pt);
+        }
+    }
+    PT_END(pt);
 }
 
 
@@ -353,8 +1074,10 @@ void myInit(void) {
 
 int main(void)
 {
-    uchar   i;
+    uint16_t disconnectStart;
+#ifdef WII_RESTART_ON_FAULT
     start:
+#endif
     cli();
     wdt_enable(WDTO_2S);
     // wdt_disable();
@@ -369,43 +1092,57 @@ int main(void)
 
     SET_BIT(DDRC, 0);
     // SET_BIT(PORTC,0);
-    // my_timer_oneshot(500, abc, 0);
-    // my_timer_abort();
+
+    my_timer_init();
 
     odDebugInit();
     usbInit();
     usbDeviceDisconnect();  /* enforce re-enumeration, do this while interrupts are disabled! */
-    i = 0;
-    while(--i){             /* fake USB disconnect for > 250 ms */
-        wdt_reset();
-        _delay_ms(1);
+    disconnectStart = my_timer_now();
+    while ((uint16_t)(my_timer_now() - disconnectStart) < MY_TIMER_MS(255)) {
+        wdt_reset();        /* fake USB disconnect for > 250 ms */
     }
     usbDeviceConnect();
     sei();
     myInit();
+    PT_INIT(&wiiPt);
+    PT_INIT(&usbPt);
+    PT_INIT(&ledPt);
+#ifdef WII_RESTART_ON_FAULT
+    wiiRestart = 0;
+#endif
     DBG1(0x01, 0, 0);       /* debug output: main loop starts */
 
     for(;;){                /* main event loop */
+#ifdef MEASURE_LOOP_TIME
+        uint16_t loopStart = my_timer_now();
+        uint16_t timerTicks;
+#endif
         DBG1(0x02, 0, 0);   /* debug output: main loop iterates */
         wdt_reset();
-        usbPoll();
-        if (fillReportWithWii() == 1) {
-            SET_BIT(PORTC,0);
-        } else {
-            CLR_BIT(PORTC,0);
+        my_timer_run();
+#ifdef MEASURE_LOOP_TIME
+        /* the tick overhead: expiring the timers and their callbacks */
+        timerTicks = my_timer_now() - loopStart;
+        timerLoad += timerTicks;
+        if (timerTicks > stats.timerMaxTicks) {
+            stats.timerMaxTicks = timerTicks;
         }
-        // TOGGLE_BIT(PORTC,0);
-        // twi_stop();
-        if(usbInterruptIsReady()){
-            /* called after every poll of the interrupt endpoint */
-            DBG1(0x03, 0, 0);   /* debug output: interrupt report prepared */
-            usbSetInterrupt((void *)&reportBuffer, sizeof(reportBuffer));
-
-            /* If the gamepad starts feeding us 0xff, we have to restart to recover */
-            if ((rawData[0] == 0xff) && (rawData[1] == 0xff) && (rawData[2] == 0xff) && (rawData[3] == 0xff) && (rawData[4] == 0xff) && (rawData[5] == 0xff)) {
-                goto start;
-            }
+#endif
+        wiiTask(&wiiPt);
+#ifdef WII_RESTART_ON_FAULT
+        if (wiiRestart) {
+            goto start;
+        }
+#endif
+        usbTask(&usbPt);
+        ledTask(&ledPt);
+#ifdef MEASURE_LOOP_TIME
+        loopStart = my_timer_now() - loopStart;
+        if (loopStart > stats.loopMaxTicks) {
+            stats.loopMaxTicks = loopStart;
         }
+#endif
     }
     return 0;
 }
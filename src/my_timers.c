@@ -1,36 +1,141 @@
 #include "my_timers.h"
 
 #include <avr/interrupt.h>
+#include <util/atomic.h>
 #include "bit_tools.h"
 #include <avr/io.h>
 
 static void (*timer_callback)(void* ptr);
 static void* timer_ptr;
 
-ISR(TIMER1_OVF_vect, ISR_NOBLOCK) {
-    // at first disable timer1
-    TCCR1B &= ~(1<<CS10|1<<CS11|1<<CS12);
+static volatile uint16_t tick_ms;       // counted by the tick interrupt
+static uint16_t wheel_ms;               // last tick processed by my_timer_run()
+static my_timer_t* wheel[MY_TIMER_SLOTS];
+
+ISR(TIMER1_COMPA_vect, ISR_NOBLOCK) {
+    // at first disable the compare interrupt, this is a oneshot
+    CLR_BIT(TIMSK, OCIE1A);
 
     // now call callback function
     timer_callback(timer_ptr);
 }
 
-uint8_t my_timer_oneshot(uint16_t time_ms, void (*callback)(void* ptr), void* ptr) {
-    // at first set callback function
-    timer_callback = callback;
-    timer_ptr = ptr;
+/*
+ * The tick. It enables interrupts at once like the handler above, as the
+ * USB interrupt must not wait. Only the compare update has to be atomic,
+ * an interrupt in between could use the TEMP register of timer1.
+ */
+ISR(TIMER1_COMPB_vect, ISR_NOBLOCK) {
+    ATOMIC_BLOCK(ATOMIC_FORCEON) {
+        OCR1B += MY_TIMER_MS(1);
+    }
+    tick_ms++;
+}
+
+void my_timer_init(void) {
+    // normal mode, let timer1 run freely with F_CPU/64
+    TCCR1A = 0;
+    TCCR1B = (1<<CS11|1<<CS10);
+
+    // first tick in a millisecond, compare unit B then keeps the pace
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        OCR1B = TCNT1 + MY_TIMER_MS(1);
+        TIFR = (1<<OCF1B);
+        SET_BIT(TIMSK, OCIE1B);
+    }
+}
+
+uint16_t my_timer_now(void) {
+    uint16_t now;
+
+    // 16 bit registers share the TEMP register with the interrupts
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        now = TCNT1;
+    }
+    return now;
+}
 
-    // now start timer1
-    TCNT1 = (uint16_t)(0xffff - (((uint32_t)(F_CPU))/(1024UL * 1000UL)) * time_ms);
+uint8_t my_timer_oneshot(uint16_t ticks, void (*callback)(void* ptr), void* ptr) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        // at first set callback function
+        timer_callback = callback;
+        timer_ptr = ptr;
 
-    TCCR1B |= (1<<CS10|1<<CS12);
-    TIMSK |= (1<<TOIE1);
+        // now arm the compare unit, a stale match must not fire at once
+        OCR1A = TCNT1 + ticks;
+        TIFR = (1<<OCF1A);
+        SET_BIT(TIMSK, OCIE1A);
+    }
 
     return 1;
 }
 
 void my_timer_abort() {
-    TCCR1B &= ~(1<<CS10|1<<CS11|1<<CS12);
+    CLR_BIT(TIMSK, OCIE1A);
+}
+
+uint16_t my_timer_ms(void) {
+    uint16_t ms;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        ms = tick_ms;
+    }
+    return ms;
+}
+
+void my_timer_start(my_timer_t* timer, uint16_t ms, void (*callback)(void* ptr), void* ptr) {
+    my_timer_t** slot;
+
+    my_timer_stop(timer);
+    timer->callback = callback;
+    timer->ptr = ptr;
+    // the tick being processed is over, 0 would wait a full wrap
+    timer->due = wheel_ms + (ms ? ms : 1);
+    timer->active = 1;
+
+    slot = &wheel[timer->due & (MY_TIMER_SLOTS - 1)];
+    timer->next = *slot;
+    *slot = timer;
 }
 
+void my_timer_stop(my_timer_t* timer) {
+    my_timer_t** link;
 
+    if (!timer->active) {
+        return;
+    }
+    timer->active = 0;
+    for (link = &wheel[timer->due & (MY_TIMER_SLOTS - 1)]; *link; link = &(*link)->next) {
+        if (*link == timer) {
+            *link = timer->next;
+            return;
+        }
+    }
+}
+
+uint16_t my_timer_run(void) {
+    uint16_t now = my_timer_ms();
+    uint16_t ticks = 0;
+
+    while (wheel_ms != now) {
+        my_timer_t** link;
+        my_timer_t* timer;
+
+        wheel_ms++;
+        ticks++;
+        link = &wheel[wheel_ms & (MY_TIMER_SLOTS - 1)];
+        while ((timer = *link)) {
+            // the others in this slot expire in a later turn of the wheel
+            if (timer->due != wheel_ms) {
+                link = &timer->next;
+                continue;
+            }
+            *link = timer->next;
+            timer->active = 0;
+            timer->callback(timer->ptr);
+            // the callback may have started or stopped timers of this slot
+            link = &wheel[wheel_ms & (MY_TIMER_SLOTS - 1)];
+        }
+    }
+    return ticks;
+}
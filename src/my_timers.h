@@ -3,16 +3,38 @@
 
 #include <stdint.h>
 
+/*
+ * Timer1 runs freely with F_CPU/64, so one tick is 4us at 16MHz and the
+ * counter wraps after 65536 ticks (262ms).
+ */
+#define MY_TIMER_PRESCALER  64UL
+
+/* convert microseconds / milliseconds to timer ticks */
+#define MY_TIMER_US(US) ((uint16_t)(((uint32_t)(F_CPU) / 1000000UL) * (US) / MY_TIMER_PRESCALER))
+#define MY_TIMER_MS(MS) ((uint16_t)(((uint32_t)(F_CPU) / 1000UL) * (MS) / MY_TIMER_PRESCALER))
+
+/*
+ * Description:
+ *  starts timer1, has to be called before any other function of this file
+ */
+void my_timer_init(void);
+
+/*
+ * Description:
+ *  returns the current value of the free running timer. Use unsigned
+ *  differences to measure time spans of up to 65535 ticks.
+ */
+uint16_t my_timer_now(void);
+
 /*
  * Description:
- *  waits time_ms milliseconds and then calls the callback function
+ *  waits 'ticks' timer ticks and then calls the callback function. The
+ *  callback is called from the interrupt with interrupts enabled.
  *
  * Side Effects:
- *  When called the timer1 is used, so you may not use it until the
- *  callback was called.
+ *  Only one oneshot can be active, starting a new one replaces the old.
  */
-
-uint8_t my_timer_oneshot(uint16_t time_ms, void (*callback)(void* ptr), void* ptr) __attribute__((signal));
+uint8_t my_timer_oneshot(uint16_t ticks, void (*callback)(void* ptr), void* ptr);
 
 /*
  * Description:
@@ -21,4 +43,54 @@ uint8_t my_timer_oneshot(uint16_t time_ms, void (*callback)(void* ptr), void* pt
 void my_timer_abort();
 
 
+/*
+ * Software timers with a resolution of one millisecond. Compare unit B
+ * interrupts once per millisecond and only counts, the timers expire in
+ * my_timer_run(), which the main loop calls. Their callbacks therefore
+ * run in the main loop and may use everything the main loop uses, but the
+ * timers must not be started or stopped from an interrupt.
+ *
+ * The timers hang in a wheel of MY_TIMER_SLOTS lists, one per millisecond
+ * modulo MY_TIMER_SLOTS, so a tick only looks at the timers of one slot.
+ */
+#define MY_TIMER_SLOTS 8    // power of two
+
+typedef struct my_timer_s {
+    struct my_timer_s* next;    // in the same slot
+    uint16_t due;               // my_timer_ms() when it expires
+    uint8_t active;
+    void (*callback)(void* ptr);
+    void* ptr;
+} my_timer_t;
+
+/*
+ * Description:
+ *  returns the milliseconds counted by the tick interrupt, wraps after
+ *  65536 ms
+ */
+uint16_t my_timer_ms(void);
+
+/*
+ * Description:
+ *  calls the callback function 'ms' milliseconds after the last tick that
+ *  my_timer_run() has processed, at least one tick later. A timer that is
+ *  already running is started again.
+ */
+void my_timer_start(my_timer_t* timer, uint16_t ms, void (*callback)(void* ptr), void* ptr);
+
+/*
+ * Description:
+ *  stops the timer if it is running
+ */
+void my_timer_stop(my_timer_t* timer);
+
+/*
+ * Description:
+ *  processes all ticks since the last call and calls the callbacks of the
+ *  timers that expired, in the order of their ticks. Returns the number of
+ *  ticks processed.
+ */
+uint16_t my_timer_run(void);
+
+
 #endif
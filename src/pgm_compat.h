@@ -0,0 +1,18 @@
+#ifndef PGM_COMPAT_H
+#define PGM_COMPAT_H
+
+/*
+ * Flash access for code that is also compiled on the build host (see
+ * host/), where flash is plain memory.
+ */
+
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+#else
+#include <string.h>
+#define PROGMEM
+#define pgm_read_byte(ADDR) (*(const unsigned char*)(ADDR))
+#define memcpy_P(DST, SRC, LEN) memcpy((DST), (SRC), (LEN))
+#endif
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef PT_H
+#define PT_H
+
+/*
+ * Protothreads: the tasks of the main loop are functions that return
+ * whenever they have to wait and carry on at the same place the next time
+ * they are called. The place is kept as a line number in pt_t and the
+ * function body is one big switch on it, so
+ *  - local variables don't survive a wait, use static ones,
+ *  - there must be no switch statement around a wait.
+ * A task returns PT_WAITING while it waits and PT_ENDED when it reached
+ * PT_END(), it starts over at the next call then.
+ *
+ * PT_SLEEP() waits on a timer of my_timers.h, the task is still called
+ * in the meantime but returns right away.
+ */
+
+#include <stdint.h>
+#include "my_timers.h"
+
+typedef struct {
+    uint16_t lc;            // line to carry on at, 0: from the start
+    uint8_t sleeping;       // PT_SLEEP() until the timer clears it
+    my_timer_t timer;
+} pt_t;
+
+#define PT_WAITING  0
+#define PT_ENDED    1
+
+static inline void pt_wake(void* ptr) {
+    ((pt_t*)ptr)->sleeping = 0;
+}
+
+/* let the task start over, a sleep in progress is canceled */
+#define PT_INIT(PT) do { \
+        my_timer_stop(&(PT)->timer); \
+        (PT)->sleeping = 0; \
+        (PT)->lc = 0; \
+    } while (0)
+
+#define PT_BEGIN(PT) switch ((PT)->lc) { case 0:
+
+#define PT_END(PT) } (PT)->lc = 0; return PT_ENDED
+
+/* returns until COND is true, it is evaluated at every call of the task */
+#define PT_WAIT_UNTIL(PT, COND) do { \
+        (PT)->lc = __LINE__; case __LINE__: \
+        if (!(COND)) return PT_WAITING; \
+    } while (0)
+
+/* gives the other tasks a turn */
+#define PT_YIELD(PT) do { \
+        (PT)->lc = __LINE__; return PT_WAITING; case __LINE__:; \
+    } while (0)
+
+/* waits MS ticks of the 1 ms timer, the first one may come at once */
+#define PT_SLEEP(PT, MS) do { \
+        (PT)->sleeping = 1; \
+        my_timer_start(&(PT)->timer, (MS), pt_wake, (PT)); \
+        PT_WAIT_UNTIL(PT, !(PT)->sleeping); \
+    } while (0)
+
+/* runs the child task THREAD, which uses CHILD, until it has ended */
+#define PT_SPAWN(PT, CHILD, THREAD) do { \
+        PT_INIT(CHILD); \
+        PT_WAIT_UNTIL(PT, (THREAD) == PT_ENDED); \
+    } while (0)
+
+#endif
@@ -0,0 +1,484 @@
+/* Name: run_sim.c
+ * Project: classic2usb, a Wii Classic Controller to USB adapter
+ *
+ * Runs the firmware in simavr with a virtual Classic Controller on the
+ * TWI and prints performance figures:
+ *  - cycles per main loop iteration, measured between two executions of
+ *    the wdr instruction, which the main loop executes once per iteration
+ *  - samples per second, i.e. complete reads of the controller data
+ *  - TWI bus occupancy, the share of time between START and STOP
+ * USB itself is not simulated. The host polls of the interrupt endpoint
+ * are emulated by taking the pending packet every -p milliseconds, i.e.
+ * usbTxLen1 is set back to USBPID_NAK like the USB interrupt does when the
+ * host fetched it. Measuring starts after the first sample, so the init
+ * phase is not included. With -c the run fails if a poll finds no packet
+ * or the same data as the poll before.
+ *
+ * With -l the virtual controller instead toggles a button at random
+ * times and the input latency is measured: from the button change to the
+ * call of usbSetInterrupt() with the new report, and to the emulated poll
+ * which delivers it to the host. The result is printed as one JSON line
+ * labeled with the given mode.
+ *
+ * With -k the virtual controller taps a button for 1 to 3 ms, with gaps of
+ * at least three polls. The run fails if a tap never reaches the host or
+ * is not released in a later packet.
+ *
+ * With -a the button changes that many times, every three to five polls.
+ * In between the report stays the same and the firmware sends nothing,
+ * but a WII_POLL_ALIGNED build has to keep its samples aligned to the
+ * polls. The run fails if a change reaches the host more than half a poll
+ * period after the end of the read that brought it in.
+ *
+ * With -r the virtual controller loses its init that many times, like a
+ * replugged controller that reads 0xff, and the recovery time from the
+ * fault to the first valid sample the firmware reads is printed as one
+ * JSON line. The run fails if a recovery takes longer than 2 s.
+ *
+ * Usage: run_sim [-m mcu] [-f frequency] [-t seconds] [-p poll ms] [-c]
+ *                [-l mode [-e events]] [-k taps] [-a changes] [-r faults]
+ *                main.elf
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <gelf.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "wii_slave.h"
+
+#define OPCODE_WDR 0x95a8
+#define USBPID_NAK 0x5a
+#define LATENCY_BUTTON 0x0010       // bit 4 of the button bytes
+#define LATENCY_TIMEOUT_MS 200      // an event not seen by then is lost
+#define RECOVERY_TIMEOUT_MS 2000    // a fault not recovered by then fails
+#define RECOVERY_GAP_MS 200         // normal operation between two faults
+
+/* Looks up a symbol of the firmware, data addresses are returned as
+ * offsets into the data space. Returns 0 if it is not found. */
+static int find_symbol(const char* file, const char* name, uint32_t* addr) {
+    Elf_Scn* scn = NULL;
+    Elf* elf;
+    int found = 0;
+    int fd = open(file, O_RDONLY);
+
+    if (fd < 0 || elf_version(EV_CURRENT) == EV_NONE) {
+        return 0;
+    }
+    elf = elf_begin(fd, ELF_C_READ, NULL);
+    while (elf && !found && (scn = elf_nextscn(elf, scn))) {
+        GElf_Shdr shdr;
+        Elf_Data* data;
+        size_t i;
+
+        if (!gelf_getshdr(scn, &shdr) || shdr.sh_type != SHT_SYMTAB || !shdr.sh_entsize) {
+            continue;
+        }
+        data = elf_getdata(scn, NULL);
+        for (i = 0; data && i < shdr.sh_size / shdr.sh_entsize; i++) {
+            GElf_Sym sym;
+            const char* n;
+
+            if (!gelf_getsym(data, i, &sym)) {
+                continue;
+            }
+            n = elf_strptr(elf, shdr.sh_link, sym.st_name);
+            if (n && !strcmp(n, name)) {
+                *addr = sym.st_value & 0xffff;  // data lives at 0x800000
+                found = 1;
+                break;
+            }
+        }
+    }
+    if (elf) {
+        elf_end(elf);
+    }
+    close(fd);
+    return found;
+}
+
+/* ------------------------------------------------------------------------- */
+/* -------------------------------- latency -------------------------------- */
+/* ------------------------------------------------------------------------- */
+
+typedef struct {
+    double* us;
+    unsigned count;
+} latencies_t;
+
+static void add_latency(latencies_t* l, uint64_t cycles, uint32_t frequency) {
+    l->us = realloc(l->us, (l->count + 1) * sizeof(double));
+    l->us[l->count++] = cycles * 1e6 / frequency;
+}
+
+static int compare_double(const void* a, const void* b) {
+    double d = *(const double*)a - *(const double*)b;
+    return (d > 0) - (d < 0);
+}
+
+static void print_latencies(const char* name, latencies_t* l) {
+    double sum = 0;
+    unsigned i;
+
+    if (!l->count) {
+        printf("\"%s\":null", name);
+        return;
+    }
+    qsort(l->us, l->count, sizeof(double), compare_double);
+    for (i = 0; i < l->count; i++) {
+        sum += l->us[i];
+    }
+    printf("\"%s\":{\"min\":%.1f,\"mean\":%.1f,\"p99\":%.1f,\"max\":%.1f}", name,
+        l->us[0], sum / l->count, l->us[(unsigned)ceil(0.99 * l->count) - 1], l->us[l->count - 1]);
+}
+
+static uint32_t rng = 1;
+
+static uint32_t next_random(void) {
+    // xorshift32, every run sees the same events
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+/* ------------------------------------------------------------------------- */
+
+int main(int argc, char** argv) {
+    const char* mcu = "atmega8";
+    const char* mode = NULL;
+    uint32_t frequency = 16000000;
+    double seconds = 1.0, pollMs = 10;
+    unsigned events = 2000;
+    elf_firmware_t firmware;
+    wii_slave_t wii;
+    avr_t* avr;
+    int opt, state;
+    uint32_t txLenAddr = 0, setInterruptAddr = 0;
+    uint64_t measureStart = 0, measureEnd = 0, nextPoll = 0, pollCycles;
+    uint64_t firstLoop = 0, lastLoop = 0, loopMax = 0, loops = 0;
+    uint32_t polls = 0, deliveries = 0, stale = 0;
+    uint8_t lastPacket[8], check = 0;
+
+    // latency measurement
+    latencies_t toSetInterrupt = {0}, toHost = {0};
+    unsigned eventCount = 0, lost = 0;
+    uint64_t eventCycle = 0, nextEvent = 0;
+    uint8_t waitReport = 0, waitHost = 0, packetHasEvent = 0;
+    uint8_t pressed = 0;
+    uint8_t lastReport[16], eventReport[16], reportLen = 0;
+
+    // tap test
+    unsigned taps = 0, tapCount = 0, tapsLost = 0, releasesLost = 0;
+    uint64_t tapEnd = 0;
+    uint8_t baseline[8], baselineValid = 0, tapSeen = 0, releaseSeen = 0;
+
+    // alignment test
+    latencies_t changeAge = {0};
+    unsigned changes = 0, changeCount = 0, lateChanges = 0;
+    uint8_t waitChange = 0;
+
+    // recovery test
+    latencies_t recovery = {0};
+    unsigned faults = 0, faultCount = 0, recoveriesSeen = 0, unrecovered = 0;
+
+    while ((opt = getopt(argc, argv, "m:f:t:p:cl:e:k:a:r:")) != -1) {
+        switch (opt) {
+            case 'm':
+                mcu = optarg;
+                break;
+            case 'f':
+                frequency = strtoul(optarg, 0, 0);
+                break;
+            case 't':
+                seconds = atof(optarg);
+                break;
+            case 'p':
+                pollMs = atof(optarg);
+                break;
+            case 'c':
+                check = 1;
+                break;
+            case 'l':
+                mode = optarg;
+                break;
+            case 'e':
+                events = atoi(optarg);
+                break;
+            case 'k':
+                taps = atoi(optarg);
+                break;
+            case 'a':
+                changes = atoi(optarg);
+                break;
+            case 'r':
+                faults = atoi(optarg);
+                break;
+            default:
+                optind = argc;
+                break;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-m mcu] [-f frequency] [-t seconds] [-p poll ms] [-c] [-l mode [-e events]] [-k taps] [-a changes] [-r faults] main.elf\n", argv[0]);
+        return 1;
+    }
+
+    memset(&firmware, 0, sizeof(firmware));
+    if (elf_read_firmware(argv[optind], &firmware)) {
+        fprintf(stderr, "%s: cannot read firmware\n", argv[optind]);
+        return 1;
+    }
+    if (!firmware.mmcu[0]) {
+        strncpy(firmware.mmcu, mcu, sizeof(firmware.mmcu) - 1);
+    }
+    if (!firmware.frequency) {
+        firmware.frequency = frequency;
+    }
+    // usbTxLen1 is the first member of usbTxStatus1
+    if (!find_symbol(argv[optind], "usbTxStatus1", &txLenAddr)) {
+        fprintf(stderr, "usbTxStatus1 not found, host polls are not emulated\n");
+    }
+    if (mode && !find_symbol(argv[optind], "usbSetInterrupt", &setInterruptAddr)) {
+        fprintf(stderr, "usbSetInterrupt not found, cannot measure latency\n");
+        return 1;
+    }
+    pollCycles = pollMs * firmware.frequency / 1000;
+
+    avr = avr_make_mcu_by_name(firmware.mmcu);
+    if (!avr) {
+        fprintf(stderr, "simavr does not know %s\n", firmware.mmcu);
+        return 1;
+    }
+    avr_init(avr);
+    avr_load_firmware(avr, &firmware);
+    wii_slave_init(avr, &wii);
+    if (mode || taps || changes) {
+        wii_slave_set_buttons(&wii, 0);
+    }
+
+    for (;;) {
+        uint16_t opcode = avr->flash[avr->pc] | (avr->flash[avr->pc + 1] << 8);
+
+        if (measureStart && opcode == OPCODE_WDR) {
+            if (lastLoop) {
+                if (avr->cycle - lastLoop > loopMax) {
+                    loopMax = avr->cycle - lastLoop;
+                }
+                loops++;
+            } else {
+                firstLoop = avr->cycle;
+            }
+            lastLoop = avr->cycle;
+        }
+        if (setInterruptAddr && avr->pc == setInterruptAddr) {
+            // the report is passed in r25:r24, its length in r22
+            uint16_t report = avr->data[24] | (avr->data[25] << 8);
+
+            reportLen = avr->data[22] < sizeof(lastReport) ? avr->data[22] : sizeof(lastReport);
+            memcpy(lastReport, avr->data + report, reportLen);
+            // all axes rest, so only the button can change the report
+            if (waitReport && memcmp(lastReport, eventReport, reportLen)) {
+                add_latency(&toSetInterrupt, avr->cycle - eventCycle, firmware.frequency);
+                waitReport = 0;
+                packetHasEvent = 1;
+            }
+        }
+
+        state = avr_run(avr);
+        if (state == cpu_Done || state == cpu_Crashed) {
+            fprintf(stderr, "simulation stopped at pc 0x%04x, state %d\n", avr->pc, state);
+            return 1;
+        }
+
+        if (txLenAddr && avr->cycle >= nextPoll) {
+            // emulated host poll: take the pending packet, if any
+            nextPoll = avr->cycle + pollCycles;
+            polls++;
+            if (!(avr->data[txLenAddr] & 0x10)) {
+                // usbTxStatus1 is len, PID, data and CRC
+                uint8_t* packet = avr->data + txLenAddr + 2;
+                uint8_t len = avr->data[txLenAddr] - 4;
+
+                len = len < sizeof(lastPacket) ? len : sizeof(lastPacket);
+                if (deliveries && !memcmp(packet, lastPacket, len)) {
+                    stale++;
+                } else if (waitChange && wii.changeReadCycle) {
+                    uint64_t age = avr->cycle - wii.changeReadCycle;
+
+                    add_latency(&changeAge, age, firmware.frequency);
+                    lateChanges += age > pollCycles / 2;
+                    waitChange = 0;
+                }
+                memcpy(lastPacket, packet, len);
+                if (taps && measureStart) {
+                    if (!baselineValid) {
+                        memcpy(baseline, packet, len);  // nothing pressed yet
+                        baselineValid = 1;
+                    } else if (memcmp(packet, baseline, len)) {
+                        tapSeen = 1;
+                    } else if (tapSeen) {
+                        releaseSeen = 1;
+                    }
+                }
+                avr->data[txLenAddr] = USBPID_NAK;
+                deliveries++;
+                if (packetHasEvent) {
+                    add_latency(&toHost, avr->cycle - eventCycle, firmware.frequency);
+                    packetHasEvent = 0;
+                    waitHost = 0;
+                }
+            }
+        }
+
+        if (!measureStart && wii.dataReads) {
+            // init is done, from now on the main loop runs
+            measureStart = avr->cycle;
+            measureEnd = measureStart + (uint64_t)(seconds * firmware.frequency);
+            nextEvent = measureStart + firmware.frequency / 10;
+            wii_slave_reset_counters(&wii);
+            polls = deliveries = stale = 0;
+        }
+        if (!measureStart && avr->cycle > 5ull * firmware.frequency) {
+            fprintf(stderr, "no sample read within 5 s, %u init writes seen\n", wii.initWrites);
+            return 1;
+        }
+
+        if (faults && measureStart) {
+            if (wii.recoveries != recoveriesSeen) {
+                recoveriesSeen = wii.recoveries;
+                add_latency(&recovery, wii.recoveryCycles, firmware.frequency);
+                nextEvent = avr->cycle + (uint64_t)RECOVERY_GAP_MS * firmware.frequency / 1000;
+            }
+            if (wii.faultCycle) {
+                if (avr->cycle - wii.faultCycle > (uint64_t)RECOVERY_TIMEOUT_MS * firmware.frequency / 1000) {
+                    unrecovered++;
+                    measureEnd = avr->cycle;
+                    break;
+                }
+            } else if (avr->cycle >= nextEvent) {
+                if (faultCount == faults) {
+                    measureEnd = avr->cycle;
+                    break;
+                }
+                wii_slave_fault(&wii);
+                faultCount++;
+            }
+        } else if (changes && measureStart) {
+            if (avr->cycle >= nextEvent) {
+                if (changeCount == changes) {
+                    measureEnd = avr->cycle;
+                    break;
+                }
+                // a change that never arrived counts as late
+                lateChanges += waitChange;
+                pressed = !pressed;
+                wii_slave_set_buttons(&wii, pressed ? LATENCY_BUTTON : 0);
+                wii.changeReadCycle = 0;
+                waitChange = 1;
+                changeCount++;
+                nextEvent = avr->cycle + 3 * pollCycles + next_random() % (2 * pollCycles + 1);
+            }
+        } else if (taps && measureStart) {
+            if (tapEnd && avr->cycle >= tapEnd) {
+                wii_slave_set_buttons(&wii, 0);
+                tapEnd = 0;
+            }
+            if (avr->cycle >= nextEvent) {
+                if (tapCount) {
+                    tapsLost += !tapSeen;
+                    releasesLost += tapSeen && !releaseSeen;
+                }
+                if (tapCount == taps) {
+                    measureEnd = avr->cycle;
+                    break;
+                }
+                if (!baselineValid) {
+                    // the first report has not been sent yet
+                    nextEvent = avr->cycle + pollCycles;
+                    continue;
+                }
+                // a tap of 1 to 3 ms, the next one after three to five polls
+                wii_slave_set_buttons(&wii, LATENCY_BUTTON);
+                tapEnd = avr->cycle + (1000 + next_random() % 2000) * (uint64_t)firmware.frequency / 1000000;
+                nextEvent = avr->cycle + 3 * pollCycles + next_random() % (2 * pollCycles + 1);
+                if (nextEvent < tapEnd + pollCycles) {
+                    nextEvent = tapEnd + pollCycles;
+                }
+                tapSeen = releaseSeen = 0;
+                tapCount++;
+            }
+        } else if (mode && measureStart) {
+            if ((waitReport || waitHost) && avr->cycle - eventCycle > (uint64_t)LATENCY_TIMEOUT_MS * firmware.frequency / 1000) {
+                lost++;
+                waitReport = waitHost = packetHasEvent = 0;
+            }
+            if (!waitReport && !waitHost && avr->cycle >= nextEvent) {
+                if (eventCount == events) {
+                    measureEnd = avr->cycle;
+                    break;
+                }
+                // toggle the button, the next event comes 2 to 12 ms later
+                pressed = !pressed;
+                wii_slave_set_buttons(&wii, pressed ? LATENCY_BUTTON : 0);
+                memcpy(eventReport, lastReport, reportLen);
+                eventCycle = avr->cycle;
+                eventCount++;
+                waitReport = waitHost = 1;
+                nextEvent = avr->cycle + (2000 + next_random() % 10000) * (uint64_t)firmware.frequency / 1000000;
+            }
+        } else if (measureEnd && avr->cycle >= measureEnd) {
+            break;
+        }
+    }
+
+    seconds = (double)(measureEnd - measureStart) / firmware.frequency;
+    if (faults) {
+        printf("{\"mcu\":\"%s\",\"f_cpu\":%u,\"faults\":%u,\"unrecovered\":%u,",
+            firmware.mmcu, firmware.frequency, faultCount, unrecovered);
+        print_latencies("recovery_us", &recovery);
+        printf("}\n");
+        return unrecovered ? 1 : 0;
+    }
+    if (changes) {
+        printf("changes %u, %u late, ", changeCount, lateChanges);
+        print_latencies("age_us", &changeAge);
+        printf("\n");
+        return lateChanges ? 1 : 0;
+    }
+    if (taps) {
+        printf("taps %u, %u lost, %u not released\n", tapCount, tapsLost, releasesLost);
+        return (tapsLost || releasesLost) ? 1 : 0;
+    }
+    if (mode) {
+        printf("{\"mode\":\"%s\",\"mcu\":\"%s\",\"f_cpu\":%u,\"poll_ms\":%g,\"events\":%u,\"lost\":%u,",
+            mode, firmware.mmcu, firmware.frequency, pollMs, eventCount, lost);
+        print_latencies("set_interrupt_us", &toSetInterrupt);
+        printf(",");
+        print_latencies("delivered_us", &toHost);
+        printf(",\"samples_per_second\":%.0f}\n", wii.dataReads / seconds);
+        return lost ? 1 : 0;
+    }
+
+    printf("mcu %s at %u Hz, %.2f s simulated after init\n", firmware.mmcu, firmware.frequency, seconds);
+    printf("init writes          %u\n", wii.initWrites);
+    printf("main loop iterations %llu\n", (unsigned long long)loops);
+    printf("cycles per iteration %.1f avg, %llu max\n",
+        loops ? (double)(lastLoop - firstLoop) / loops : 0.0, (unsigned long long)loopMax);
+    printf("samples per second   %.0f\n", wii.dataReads / seconds);
+    printf("TWI transfers        %u\n", wii.transfers);
+    printf("TWI bus occupancy    %.1f %%\n", 100.0 * wii.busCycles / (measureEnd - measureStart));
+    if (txLenAddr) {
+        printf("host polls           %u, %u missed, %u stale\n", polls, polls - deliveries, stale);
+        if (check && (polls != deliveries || stale)) {
+            fprintf(stderr, "not every poll got a new sample\n");
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,182 @@
+/* Name: wii_slave.c
+ * Project: classic2usb, a Wii Classic Controller to USB adapter
+ */
+
+#include <string.h>
+
+#include "avr_twi.h"
+#include "sim_io.h"
+#include "wii_slave.h"
+
+static const char* irq_names[2] = {
+    [TWI_IRQ_INPUT] = "8>wii.out",
+    [TWI_IRQ_OUTPUT] = "32<wii.in",
+};
+
+/* Number of data bytes in the selected data format */
+static int data_length(wii_slave_t* p) {
+    return p->reg[0xfe] == 0x03 ? 8 : 6;
+}
+
+/*
+ * Writes the controller data for the current frame: the left stick moves
+ * in a sweep, the right stick and triggers ramp and one button toggles now
+ * and then. The sweep is fast enough to change the data of every frame.
+ * Once wii_slave_set_buttons() has been called, the sticks rest in the
+ * center and only the scripted buttons change. Buttons are active low.
+ */
+static void update_data(wii_slave_t* p) {
+    uint8_t n = p->frame * 8;
+    uint8_t lx = n, ly = 255 - n, rx = n, ry = 128, lt = n, rt = 0;
+    uint16_t buttons = (p->frame & 0x40) ? 0xffef : 0xffff;
+
+    if (p->faulted) {
+        memset(p->reg, 0xff, data_length(p));
+        return;
+    }
+    if (p->scripted) {
+        lx = ly = rx = ry = 128;
+        lt = rt = 0;
+        buttons = ~p->pressed;
+    }
+    if (data_length(p) == 8) {
+        p->reg[0] = lx;
+        p->reg[1] = rx;
+        p->reg[2] = ly;
+        p->reg[3] = ry;
+        p->reg[4] = lt;
+        p->reg[5] = rt;
+        p->reg[6] = buttons;
+        p->reg[7] = buttons >> 8;
+    } else {
+        lx >>= 2; ly >>= 2;
+        rx >>= 3; ry >>= 3; lt >>= 3; rt >>= 3;
+        p->reg[0] = ((rx & 0x18) << 3) | lx;
+        p->reg[1] = ((rx & 0x06) << 5) | ly;
+        p->reg[2] = ((rx & 0x01) << 7) | ((lt & 0x18) << 2) | ry;
+        p->reg[3] = ((lt & 0x07) << 5) | rt;
+        p->reg[4] = buttons;
+        p->reg[5] = buttons >> 8;
+    }
+}
+
+static void next_sample(wii_slave_t* p) {
+    p->frame++;
+    update_data(p);
+}
+
+static void stop(wii_slave_t* p) {
+    if (p->busStart) {
+        p->busCycles += p->avr->cycle - p->busStart;
+        p->busStart = 0;
+    }
+    if (p->selected && (p->selected & 1) && p->readStart == 0 && p->byteCount >= data_length(p)) {
+        p->dataReads++;
+        if (p->changePending) {
+            p->changePending = 0;
+            p->changeReadCycle = p->avr->cycle;
+        }
+        if (p->faultCycle && !p->faulted) {
+            p->recoveryCycles = p->avr->cycle - p->faultCycle;
+            p->recoveries++;
+            p->faultCycle = 0;
+        }
+        next_sample(p);
+    }
+    p->selected = 0;
+}
+
+/* Called by the TWI master for every bus event */
+static void twi_hook(struct avr_irq_t* irq, uint32_t value, void* param) {
+    wii_slave_t* p = (wii_slave_t*)param;
+    avr_twi_msg_irq_t v;
+
+    v.u.v = value;
+
+    if (v.u.twi.msg & TWI_COND_STOP) {
+        stop(p);
+    }
+    if (v.u.twi.msg & TWI_COND_START) {
+        if (!p->busStart) {
+            p->busStart = p->avr->cycle;
+        }
+        p->selected = 0;
+        if ((v.u.twi.addr >> 1) == WII_SLAVE_ADDR) {
+            p->selected = v.u.twi.addr;
+            p->readStart = p->pointer;
+            p->byteCount = 0;
+            p->transfers++;
+            avr_raise_irq(p->irq + TWI_IRQ_INPUT, avr_twi_irq_msg(TWI_COND_ACK, p->selected, 1));
+        }
+    }
+    if (!p->selected) {
+        return;
+    }
+    if (v.u.twi.msg & TWI_COND_WRITE) {
+        uint8_t faulted = p->faulted;
+
+        avr_raise_irq(p->irq + TWI_IRQ_INPUT, avr_twi_irq_msg(TWI_COND_ACK, p->selected, 1));
+        if (p->byteCount++ == 0) {
+            p->pointer = v.u.twi.data;
+        } else {
+            switch (p->pointer) {
+                case 0xfb: case 0x40:
+                    p->faulted = 0;     // initialized again
+                    // no break
+                case 0xf0: case 0xfe:
+                    p->initWrites++;
+                    break;
+            }
+            p->reg[p->pointer++] = v.u.twi.data;
+            if (p->pointer == 0xff || faulted != p->faulted) {
+                update_data(p);     // data format or init may have changed
+            }
+        }
+        p->readStart = 0xff;        // a write is not a data read
+    }
+    if (v.u.twi.msg & TWI_COND_READ) {
+        avr_raise_irq(p->irq + TWI_IRQ_INPUT, avr_twi_irq_msg(TWI_COND_READ, p->selected, p->reg[p->pointer++]));
+        p->byteCount++;
+    }
+}
+
+void wii_slave_init(avr_t* avr, wii_slave_t* p) {
+    memset(p, 0, sizeof(*p));
+    p->avr = avr;
+    // identification of a Classic Controller
+    p->reg[0xfa] = 0x00;
+    p->reg[0xfb] = 0x00;
+    p->reg[0xfc] = 0xa4;
+    p->reg[0xfd] = 0x20;
+    p->reg[0xfe] = 0x01;
+    p->reg[0xff] = 0x01;
+    update_data(p);
+
+    p->irq = avr_alloc_irq(&avr->irq_pool, 0, 2, irq_names);
+    avr_irq_register_notify(p->irq + TWI_IRQ_OUTPUT, twi_hook, p);
+
+    avr_connect_irq(p->irq + TWI_IRQ_INPUT, avr_io_getirq(avr, AVR_IOCTL_TWI_GETIRQ(0), TWI_IRQ_INPUT));
+    avr_connect_irq(avr_io_getirq(avr, AVR_IOCTL_TWI_GETIRQ(0), TWI_IRQ_OUTPUT), p->irq + TWI_IRQ_OUTPUT);
+}
+
+void wii_slave_reset_counters(wii_slave_t* p) {
+    p->dataReads = 0;
+    p->transfers = 0;
+    p->busCycles = 0;
+    if (p->busStart) {
+        p->busStart = p->avr->cycle;
+    }
+}
+
+void wii_slave_fault(wii_slave_t* p) {
+    p->faulted = 1;
+    p->faultCycle = p->avr->cycle;
+    update_data(p);
+}
+
+void wii_slave_set_buttons(wii_slave_t* p, uint16_t pressed) {
+    p->scripted = 1;
+    p->pressed = pressed;
+    p->changePending = 1;
+    update_data(p);
+}
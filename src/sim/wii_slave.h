@@ -0,0 +1,96 @@
+/* Name: wii_slave.h
+ * Project: classic2usb, a Wii Classic Controller to USB adapter
+ *
+ * A virtual Wii Classic Controller for simavr. It is attached to the TWI
+ * of the simulated AVR and answers at address 0x52 like the real
+ * extension: writes set the register pointer and registers, reads return
+ * registers starting at the pointer. By default the controller data at
+ * register 0 changes after every read so the firmware always sees new
+ * samples, benchmarks can script the buttons instead. A fault makes it
+ * forget its init like a replugged controller, it then reads 0xff until
+ * the firmware initializes it again.
+ */
+
+#ifndef WII_SLAVE_H_
+#define WII_SLAVE_H_
+
+#include <stdint.h>
+#include "sim_avr.h"
+
+#define WII_SLAVE_ADDR 0x52
+
+typedef struct {
+    avr_irq_t* irq;                 // TWI_IRQ_INPUT and TWI_IRQ_OUTPUT
+    avr_t* avr;
+    uint8_t reg[256];
+    uint8_t pointer;
+    uint8_t selected;               // address byte of the current transfer
+    uint8_t readStart;              // pointer when the read started
+    uint8_t byteCount;              // bytes in the current transfer
+
+    uint32_t frame;                 // number of samples produced
+    uint8_t scripted;               // see wii_slave_set_buttons()
+    uint16_t pressed;               // bit n is bit n of the button bytes
+    uint32_t dataReads;             // complete reads of the controller data
+    uint32_t initWrites;            // writes to 0xf0, 0xfb, 0x40 and 0xfe
+    uint32_t transfers;
+    uint8_t changePending;          // set_buttons() since the last data read
+    uint64_t changeReadCycle;       // end of the first data read after it
+
+    uint8_t faulted;                // reads 0xff until the next init
+    uint64_t faultCycle;            // cycle of the fault, 0 once recovered
+    uint64_t recoveryCycles;        // fault to the first valid data read
+    uint32_t recoveries;
+
+    uint64_t busStart;              // cycle of the START, 0 if the bus is idle
+    uint64_t busCycles;             // cycles between START and STOP
+} wii_slave_t;
+
+void wii_slave_init(avr_t* avr, wii_slave_t* p);
+/*
+Description:
+    Creates the IRQs of the slave and connects them to TWI 0 of avr.
+Parameters:
+    avr         The simulated AVR.
+    p           The slave, does not need to be initialized.
+Returnvalue:
+    none
+*/
+
+void wii_slave_reset_counters(wii_slave_t* p);
+/*
+Description:
+    Clears the statistic counters, e.g. when the measurement starts.
+Parameters:
+    p           The slave.
+Returnvalue:
+    none
+*/
+
+void wii_slave_set_buttons(wii_slave_t* p, uint16_t pressed);
+/*
+Description:
+    Stops the sweep, centers the sticks and presses the given buttons. The
+    registers change at once, a read that is already running returns the
+    new state from the next byte on. The end of the first complete data
+    read after the call is kept in changeReadCycle.
+Parameters:
+    p           The slave.
+    pressed     Bit n set means bit n of the button bytes reads as pressed.
+Returnvalue:
+    none
+*/
+
+void wii_slave_fault(wii_slave_t* p);
+/*
+Description:
+    Makes the controller lose its init. All data reads return 0xff until
+    0xfb or 0x40 is written. The first complete data read after that sets
+    recoveryCycles and increments recoveries.
+Parameters:
+    p           The slave.
+Returnvalue:
+    none
+*/
+
+#endif /* WII_SLAVE_H_ */
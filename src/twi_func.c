@@ -1,31 +1,67 @@
 #include "twi_func.h"
 
 #include <avr/io.h>
-#include <util/delay.h>     /* for _delay_ms() */
+#include <util/delay.h>     /* for _delay_us() */
 #include <avr/interrupt.h>
+#include <util/atomic.h>
 #include "my_timers.h"
 
 #include "bit_tools.h"
 
-#define WAIT_FOR_TWI(TIMEOUT) {\
-                                 long int tmp_n = 0;\
-                                 while (!(TWCR & (1<<TWINT)) && (tmp_n < 100000)) tmp_n++;\
-                                 if (!(TWCR & (1<<TWINT))) { SET_BIT(TWCR, TWINT); goto fend; }\
-                              }
+#define TWI_BYTE_TICKS MY_TIMER_US(TWI_BYTE_TIMEOUT_US)
+#define TWI_XFER_TICKS MY_TIMER_US(TWI_XFER_TIMEOUT_US)
+
+#if TWI_XFER_TIMEOUT_US < TWI_BYTE_TIMEOUT_US
+#error TWI_XFER_TIMEOUT_US has to be at least TWI_BYTE_TIMEOUT_US
+#endif
+
+// pins of the TWI, used as port pins by twi_bus_clear()
+#ifndef TWI_PORT
+#define TWI_PORT    PORTC
+#define TWI_DDR     DDRC
+#define TWI_PIN     PINC
+#define TWI_SDA     PC4
+#define TWI_SCL     PC5
+#endif
+
+// start of the current blocking transaction
+static uint16_t twi_xfer_start;
+
+/*
+ * Waits until TWINT is set. If the byte or the whole transaction takes too
+ * long the TWI is switched off, so a slave that holds SCL or SDA low can't
+ * keep the hardware waiting for a STOP that never makes it onto the bus.
+ */
+static unsigned char twi_wait(void) {
+    uint16_t start = my_timer_now();
+
+    while (!(TWCR & (1<<TWINT))) {
+        uint16_t now = my_timer_now();
+
+        if (((uint16_t)(now - start) > TWI_BYTE_TICKS) || ((uint16_t)(now - twi_xfer_start) > TWI_XFER_TICKS)) {
+            twi_bus_clear();
+            return 0;
+        }
+    }
+    return 1;
+}
 
-// #define WAIT_FOR_TWI(TIMEOUT) while (!(TWCR & (1<<TWINT)));
+// after a timeout there is no point in sending a STOP
+#define WAIT_FOR_TWI() if (!twi_wait()) return 0;
 
-unsigned char twi_send_data(unsigned char addr, unsigned char* data, unsigned char len) {
+/*
+ * Sends START, SLA+W and the data, without the STOP. Returns 0 if that
+ * failed, the STOP has been sent then or the bus been cleared. A START
+ * in the middle of a transaction becomes a repeated START.
+ */
+static unsigned char twi_write(unsigned char addr, unsigned char* data, unsigned char len) {
     unsigned char i;
-    // long int n;
-    // volatile unsigned char timeout = 0;
-    
+
     // enable TWI and send start condition
     TWCR = (1<<TWINT)|(1<<TWSTA)|(1<<TWEN);
 
     // wait until it has been transmited
-    // while (!(TWCR & (1<<TWINT)));
-    WAIT_FOR_TWI(10);
+    WAIT_FOR_TWI();
 
     // check if start was sent
     if (((TWSR & 0xf8) != 0x08) && ((TWSR & 0xf8) != 0x10)) {
@@ -37,22 +73,19 @@ unsigned char twi_send_data(unsigned char addr, unsigned char* data, unsigned ch
     TWCR = (1<<TWINT) | (1<<TWEN);
 
     // wait until it has been transmited
-    WAIT_FOR_TWI(10);
+    WAIT_FOR_TWI();
     
     if ((TWSR & 0xf8) != 0x18) {
         goto fend;
     }
 
-    // _delay_us(20);
-
     // now send data
     for (i = 0; i < len; i++) {
         TWDR = data[i];
         TWCR = (1<<TWINT) | (1<<TWEN);
 
         // wait until it has been transmited
-        // while (!(TWCR & (1<<TWINT)));
-        WAIT_FOR_TWI(10);
+        WAIT_FOR_TWI();
 
         // check if data was acked by slave
         if ((TWSR & 0xf8) != 0x28) {
@@ -60,30 +93,23 @@ unsigned char twi_send_data(unsigned char addr, unsigned char* data, unsigned ch
         }
     }
 
-    // send stop
-    twi_stop();
-
     return 1;
 
-
     fend:
     // if an error occurs send stop and return 0
     twi_stop();
     return 0;
-    
 }
 
-unsigned char twi_receive_data(unsigned char addr, unsigned char* data, unsigned char len) {
+/* Same as twi_write() for START, SLA+R and reading the data */
+static unsigned char twi_read(unsigned char addr, unsigned char* data, unsigned char len) {
     unsigned char i;
-    // long int n;
-    // volatile unsigned char timeout = 0;
-    
+
     // enable TWI and send start condition
     TWCR = (1<<TWINT)|(1<<TWSTA)|(1<<TWEN);
 
     // wait until it has been transmited
-    // while (!(TWCR & (1<<TWINT)));
-    WAIT_FOR_TWI(10);
+    WAIT_FOR_TWI();
     
     // check if start was sent
     if (((TWSR & 0xf8) != 0x08) && ((TWSR & 0xf8) != 0x10)) {
@@ -94,11 +120,9 @@ unsigned char twi_receive_data(unsigned char addr, unsigned char* data, unsigned
     TWCR = (1<<TWINT) | (1<<TWEN);
 
     // wait until it has been transmited
-    // while (!(TWCR & (1<<TWINT)));
-    WAIT_FOR_TWI(10);
+    WAIT_FOR_TWI();
 
-    
-    // check if start was sent
+    // check if SLA+R was acked
     if ((TWSR & 0xf8) != 0x40) {
         goto fend;
     }
@@ -110,8 +134,7 @@ unsigned char twi_receive_data(unsigned char addr, unsigned char* data, unsigned
         TWCR = (1<<TWINT)|(1<<TWEA)|(1<<TWEN);
 
         // wait until it has been transmited
-        // while (!(TWCR & (1<<TWINT)));
-        WAIT_FOR_TWI(10);
+        WAIT_FOR_TWI();
 
         // check if data was received
         if ((TWSR & 0xf8) != 0x50) {
@@ -121,18 +144,293 @@ unsigned char twi_receive_data(unsigned char addr, unsigned char* data, unsigned
         data[i] = TWDR; // get data
     }
 
+    return 1;
+
+    fend:
     twi_stop();
+    return 0;
+}
 
+unsigned char twi_send_data(unsigned char addr, unsigned char* data, unsigned char len) {
+    twi_xfer_start = my_timer_now();
+    if (!twi_write(addr, data, len)) {
+        return 0;
+    }
+    twi_stop();
     return 1;
+}
 
-    fend:
+unsigned char twi_receive_data(unsigned char addr, unsigned char* data, unsigned char len) {
+    twi_xfer_start = my_timer_now();
+    if (!twi_read(addr, data, len)) {
+        return 0;
+    }
+    twi_stop();
+    return 1;
+}
 
+unsigned char twi_send_receive_data(unsigned char addr, unsigned char* out, unsigned char outLen,
+                                    unsigned char* in, unsigned char inLen, unsigned char repeatedStart) {
+    // both parts share the transaction timeout
+    twi_xfer_start = my_timer_now();
+    if (!twi_write(addr, out, outLen)) {
+        return 0;
+    }
+    if (!repeatedStart) {
+        twi_stop();
+    }
+    if (!twi_read(addr, in, inLen)) {
+        return 0;
+    }
     twi_stop();
-    return 0;
+    return 1;
 }
 
 
 void twi_stop(void) {
+    uint16_t start = my_timer_now();
+
+    TWCR = (1<<TWINT)|(1<<TWEN)|(1<<TWSTO);
+
+    // the hardware clears TWSTO once the STOP is on the bus
+    while (TWCR & (1<<TWSTO)) {
+        if ((uint16_t)(my_timer_now() - start) > TWI_BYTE_TICKS) {
+            twi_bus_clear();
+            return;
+        }
+    }
+}
+
+/*
+ * The pins are open drain: low means the port drives 0, released means
+ * input with the pull-up as it was before, if any. The port bit has to be
+ * cleared before the pin becomes an output, or it would drive high.
+ */
+#define TWI_PIN_LOW(BIT)      { CLR_BIT(TWI_PORT, BIT); SET_BIT(TWI_DDR, BIT); }
+#define TWI_PIN_RELEASE(BIT)  { CLR_BIT(TWI_DDR, BIT); TWI_PORT |= pullups & (1<<(BIT)); }
+#define TWI_PIN_HIGH(BIT)     GET_BIT(TWI_PIN, BIT)
+
+unsigned char twi_bus_clear(void) {
+    unsigned char i;
+    unsigned char pullups;
+    uint16_t start;
+
+    // with the TWI off the pins belong to the port again
+    TWCR = 0;
+    if (TWI_PIN_HIGH(TWI_SDA) && TWI_PIN_HIGH(TWI_SCL)) {
+        return 1;
+    }
+
+    // a slave may stretch the clock, give it the time of a byte
+    start = my_timer_now();
+    while (!TWI_PIN_HIGH(TWI_SCL)) {
+        if ((uint16_t)(my_timer_now() - start) > TWI_BYTE_TICKS) {
+            return 0;   // nothing we can do about it
+        }
+    }
+
+    pullups = TWI_PORT & ((1<<TWI_SDA)|(1<<TWI_SCL));
+
+    // clock out the rest of the byte the slave is sending, it lets go of
+    // SDA at the latest when it sees the missing ACK
+    for (i = 0; (i < 9) && !TWI_PIN_HIGH(TWI_SDA); i++) {
+        TWI_PIN_LOW(TWI_SCL);
+        _delay_us(TWI_CLEAR_HALF_US);
+        TWI_PIN_RELEASE(TWI_SCL);
+        _delay_us(TWI_CLEAR_HALF_US);
+    }
+
+    // STOP: SDA goes up while SCL is high
+    TWI_PIN_LOW(TWI_SCL);
+    TWI_PIN_LOW(TWI_SDA);
+    _delay_us(TWI_CLEAR_HALF_US);
+    TWI_PIN_RELEASE(TWI_SCL);
+    _delay_us(TWI_CLEAR_HALF_US);
+    TWI_PIN_RELEASE(TWI_SDA);
+    _delay_us(TWI_CLEAR_HALF_US);
+
+    return TWI_PIN_HIGH(TWI_SDA) && TWI_PIN_HIGH(TWI_SCL);
+}
+
+
+/* ------------------------------------------------------------------------- */
+/* ------------------ interrupt driven (asynchronous) mode ----------------- */
+/* ------------------------------------------------------------------------- */
+
+static unsigned char* volatile twi_buf;
+static volatile unsigned char twi_len;
+static volatile unsigned char twi_idx;
+static volatile unsigned char twi_sla;      // slave address + R/W bit
+static unsigned char* volatile twi_in_buf;  // read that follows the write
+static volatile unsigned char twi_in_len;   // 0 if there is none
+static volatile unsigned char twi_in_start; // START flags of that read
+static volatile unsigned char twi_state = TWI_IDLE;
+static twi_callback_t twi_callback;
+static uint16_t twi_start_time;             // of the running transaction
+static volatile uint16_t twi_ticks;         // the last one took that long
+
+// hand the bus back to the hardware and get an interrupt when it is done
+#define TWI_CONTINUE(FLAGS) TWCR = (1<<TWINT)|(1<<TWEN)|(1<<TWIE)|(FLAGS)
+
+static unsigned char twi_start(unsigned char sla, unsigned char* data, unsigned char len,
+                               unsigned char* in, unsigned char inLen, unsigned char inStart, twi_callback_t callback) {
+    // the STOP of the last transaction may still be on the bus
+    if ((twi_state == TWI_BUSY) || (TWCR & (1<<TWSTO))) {
+        return 0;
+    }
+
+    twi_buf = data;
+    twi_len = len;
+    twi_idx = 0;
+    twi_sla = sla;
+    twi_in_buf = in;
+    twi_in_len = inLen;
+    twi_in_start = inStart;
+    twi_callback = callback;
+    twi_state = TWI_BUSY;
+    twi_start_time = my_timer_now();
+
+    // send start condition, everything else happens in the interrupt
+    TWI_CONTINUE(1<<TWSTA);
+
+    return 1;
+}
+
+unsigned char twi_start_send(unsigned char addr, unsigned char* data, unsigned char len, twi_callback_t callback) {
+    return twi_start((addr<<1) + 0, data, len, 0, 0, 0, callback); // WRITE MODE
+}
+
+unsigned char twi_start_receive(unsigned char addr, unsigned char* data, unsigned char len, twi_callback_t callback) {
+    return twi_start((addr<<1) + 1, data, len, 0, 0, 0, callback); // READ MODE
+}
+
+unsigned char twi_start_send_receive(unsigned char addr, unsigned char* out, unsigned char outLen,
+                                     unsigned char* in, unsigned char inLen, unsigned char repeatedStart,
+                                     twi_callback_t callback) {
+    // with both TWSTA and TWSTO the hardware sends a STOP, then a START
+    return twi_start((addr<<1) + 0, out, outLen, in, inLen,
+                     repeatedStart ? (1<<TWSTA) : (1<<TWSTA)|(1<<TWSTO), callback);
+}
+
+uint16_t twi_duration(void) {
+    uint16_t ticks;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        ticks = twi_ticks;
+    }
+    return ticks;
+}
+
+unsigned char twi_status(void) {
+    if (twi_state == TWI_BUSY) {
+        unsigned char timedOut = 0;
+        uint16_t start = twi_start_time;
+
+        // keep the cli window short for INT0, only the switch-off is atomic
+        if ((uint16_t)(my_timer_now() - start) <= TWI_XFER_TICKS) {
+            return twi_state;
+        }
+        // the interrupt must not hand the bus back while we switch it off,
+        // and a timer callback may have started the next transaction
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            if ((twi_state == TWI_BUSY) && (twi_start_time == start)) {
+                TWCR = 0;
+                twi_state = TWI_ERROR;
+                timedOut = 1;
+            }
+        }
+        if (timedOut) {
+            // the TWI is off, no interrupt can come any more
+            twi_bus_clear();
+        }
+    }
+    return twi_state;
+}
+
+void twi_abort(void) {
+    TWCR = 0;
+    twi_state = TWI_IDLE;
+}
+
+/*
+ * TWINT is not cleared when the vector is entered, so with a plain
+ * ISR_NOBLOCK handler the interrupt would fire again right after the sei.
+ * This stub masks TWIE first and then enables interrupts, so INT0 of the
+ * USB driver is never blocked for more than a handful of cycles. The state
+ * machine below re-enables TWIE when it hands the bus back to the hardware.
+ * The host build for the TWI mock has no vector, see host/twi_mock.c.
+ */
+#ifdef __AVR__
+ISR(TWI_vect, ISR_NAKED) {
+    asm volatile(
+        "push r24"              "\n\t"
+        "in   r24, __SREG__"    "\n\t"
+        "push r24"              "\n\t"
+        "in   r24, %[twcr]"     "\n\t"
+        "andi r24, %[mask]"     "\n\t"  // don't write a 1 to TWINT here!
+        "out  %[twcr], r24"     "\n\t"
+        "pop  r24"              "\n\t"
+        "out  __SREG__, r24"    "\n\t"
+        "pop  r24"              "\n\t"
+        "sei"                   "\n\t"
+        "rjmp __vector_twi_deferred" "\n\t"
+        :
+        : [twcr] "n" (_SFR_IO_ADDR(TWCR)),
+          [mask] "n" ((unsigned char)~((1<<TWINT)|(1<<TWIE)))
+    );
+}
+#endif
+
+ISR(__vector_twi_deferred) {
+    unsigned char status = TWSR & 0xf8;
+
+    switch (status) {
+        case 0x08: // start was sent
+        case 0x10: // repeated start was sent
+            TWDR = twi_sla;
+            TWI_CONTINUE(0);
+            return;
+
+        case 0x18: // SLA+W was acked
+        case 0x28: // data was acked by slave
+            if (twi_idx < twi_len) {
+                TWDR = twi_buf[twi_idx++];
+                TWI_CONTINUE(0);
+                return;
+            }
+            if (twi_in_len) {
+                // go on with the read in the same transaction
+                twi_buf = twi_in_buf;
+                twi_len = twi_in_len;
+                twi_in_len = 0;
+                twi_idx = 0;
+                twi_sla |= 1;
+                TWI_CONTINUE(twi_in_start);
+                return;
+            }
+            break;
+
+        case 0x50: // data was received
+            twi_buf[twi_idx++] = TWDR;
+            // no break
+        case 0x40: // SLA+R was acked
+            if (twi_idx < twi_len) {
+                TWI_CONTINUE(1<<TWEA);
+                return;
+            }
+            break;
+
+        default: // NACK, arbitration lost or bus error
+            status = 0;
+            break;
+    }
+
+    // send stop, the next start has to wait until TWSTO is cleared again
     TWCR = (1<<TWINT)|(1<<TWEN)|(1<<TWSTO);
-    _delay_us(10);
+    twi_ticks = my_timer_now() - twi_start_time;
+
+    twi_state = status ? TWI_DONE : TWI_ERROR;
+    if (twi_callback) {
+        twi_callback(twi_state);
+    }
 }
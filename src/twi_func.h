@@ -1,7 +1,7 @@
 #ifndef INCLUDE_TWI_FUNC_H
 #define INCLUDE_TWI_FUNC_H
 
-// #include <stdint.h>
+#include <stdint.h>
 #include <avr/io.h>
 
 /***** ATTENTION ***** ATTENTION ***** ATTENTION *****/
@@ -10,6 +10,32 @@
 /*                                                   */
 /***** ATTENTION ***** ATTENTION ***** ATTENTION *****/
 
+/*
+ * Timeouts, measured with timer1 (see my_timers.h), so they don't depend
+ * on the compiler output or the clock. my_timer_init() has to be called
+ * before any transfer. A byte (or START) that takes longer than
+ * TWI_BYTE_TIMEOUT_US, or a transaction that takes longer than
+ * TWI_XFER_TIMEOUT_US as a whole, is dropped and the TWI is switched off,
+ * which releases the bus. So a blocking call never stalls the CPU for
+ * more than TWI_XFER_TIMEOUT_US plus TWI_STOP_TIMEOUT_US, and a sample,
+ * i.e. the request and the read, never holds up the acquisition for more
+ * than TWI_SAMPLE_STALL_US.
+ */
+#ifndef TWI_BYTE_TIMEOUT_US
+#define TWI_BYTE_TIMEOUT_US 250
+#endif
+#ifndef TWI_XFER_TIMEOUT_US
+#define TWI_XFER_TIMEOUT_US 1500
+#endif
+/* half a clock period of twi_bus_clear(), 100 kHz */
+#define TWI_CLEAR_HALF_US 5
+/* twi_bus_clear() waits a byte timeout for a stretched SCL, then clocks
+ * up to nine pulses and a STOP, 21 half periods */
+#define TWI_CLEAR_TIMEOUT_US (TWI_BYTE_TIMEOUT_US + 21UL * TWI_CLEAR_HALF_US)
+/* twi_stop() waits a byte timeout for the STOP, then clears the bus */
+#define TWI_STOP_TIMEOUT_US (TWI_BYTE_TIMEOUT_US + TWI_CLEAR_TIMEOUT_US)
+#define TWI_SAMPLE_STALL_US (2UL * (TWI_XFER_TIMEOUT_US + TWI_STOP_TIMEOUT_US))
+
 /*
  * Description:
  *  Use master-send mode to send data to slave with addresse 'addr'.
@@ -41,8 +67,142 @@ unsigned char twi_receive_data(unsigned char addr, unsigned char* data, unsigned
 
 /*
  * Description:
- *  Sends TWI Stop-condition
+ *  Writes to the slave and reads from it in one transaction, e.g. a
+ *  register address followed by its contents. Between the two parts a
+ *  repeated START keeps the bus, which not every slave tolerates, or a
+ *  STOP and a new START are sent.
+ *
+ * Parameters:
+ *  addr          : Addresse of slave
+ *  out           : Pointer to buffer that holds the data to be sent
+ *  outLen        : no. of bytes to send
+ *  in            : Pointer to buffer that will hold the data
+ *  inLen         : no. of bytes to receive
+ *  repeatedStart : 1 for a repeated START, 0 for STOP and START
+ *
+ * Returnvalue:
+ *  0 if something went wrong. 1 else.
+ */
+unsigned char twi_send_receive_data(unsigned char addr, unsigned char* out, unsigned char outLen,
+                                    unsigned char* in, unsigned char inLen, unsigned char repeatedStart);
+
+/*
+ * Description:
+ *  Sends TWI Stop-condition and waits until it is on the bus, i.e. until
+ *  the hardware clears TWSTO. If that takes longer than a byte the bus is
+ *  cleared, see twi_bus_clear().
  */
 void twi_stop(void);
 
+/*
+ * Description:
+ *  Frees a bus that a slave holds, e.g. after it was unplugged in the
+ *  middle of a byte. The TWI is switched off and, if SDA is low, SCL is
+ *  driven as a port pin for up to nine clock pulses until the slave lets
+ *  go, followed by a STOP. The TWI is enabled again by the next transfer.
+ *  Takes about 0.2 ms when it has to clock, next to nothing on an idle
+ *  bus. Called by the driver after every timeout.
+ *
+ * Returnvalue:
+ *  0 if SDA or SCL are still low afterwards. 1 else.
+ */
+unsigned char twi_bus_clear(void);
+
+
+/* ------------------------------------------------------------------------- */
+/* ------------------ interrupt driven (asynchronous) mode ----------------- */
+/* ------------------------------------------------------------------------- */
+
+/* The blocking functions above must not be called while an asynchronous
+ * transaction is running. */
+
+/* states of the asynchronous TWI engine, see twi_status() */
+#define TWI_IDLE    0   /* nothing has been started yet */
+#define TWI_BUSY    1   /* transaction is in progress */
+#define TWI_DONE    2   /* last transaction completed successfully */
+#define TWI_ERROR   3   /* last transaction failed, STOP has been sent */
+
+/*
+ * Description:
+ *  Type of the function that is called when an asynchronous transaction
+ *  has finished. It is called from the TWI interrupt with interrupts
+ *  enabled, so keep it short.
+ *
+ * Parameters:
+ *  status : TWI_DONE or TWI_ERROR
+ */
+typedef void (*twi_callback_t)(unsigned char status);
+
+/*
+ * Description:
+ *  Starts an interrupt driven master-send transaction and returns at once.
+ *  The buffer must stay valid until the transaction has finished.
+ *
+ * Parameters:
+ *  addr     : Addresse of slave to send data to
+ *  data     : Pointer to buffer that holds the data to be sent
+ *  len      : no. of bytes to send
+ *  callback : function to call on completion, may be 0
+ *
+ * Returnvalue:
+ *  0 if the bus is still busy with another transaction. 1 else.
+ */
+unsigned char twi_start_send(unsigned char addr, unsigned char* data, unsigned char len, twi_callback_t callback);
+
+/*
+ * Description:
+ *  Starts an interrupt driven master-receive transaction and returns at
+ *  once. The buffer is filled in the background.
+ *
+ * Parameters:
+ *  addr     : Addresse of slave to receive data from
+ *  data     : Pointer to buffer that will hold the data
+ *  len      : no. of bytes to receive
+ *  callback : function to call on completion, may be 0
+ *
+ * Returnvalue:
+ *  0 if the bus is still busy with another transaction. 1 else.
+ */
+unsigned char twi_start_receive(unsigned char addr, unsigned char* data, unsigned char len, twi_callback_t callback);
+
+/*
+ * Description:
+ *  Starts an interrupt driven write followed by a read in one transaction,
+ *  see twi_send_receive_data(). Both buffers must stay valid until the
+ *  transaction has finished, the callback is called once at the end.
+ *
+ * Returnvalue:
+ *  0 if the bus is still busy with another transaction. 1 else.
+ */
+unsigned char twi_start_send_receive(unsigned char addr, unsigned char* out, unsigned char outLen,
+                                     unsigned char* in, unsigned char inLen, unsigned char repeatedStart,
+                                     twi_callback_t callback);
+
+/*
+ * Description:
+ *  Polls the state of the asynchronous engine. A transaction that has
+ *  been running for more than TWI_XFER_TIMEOUT_US is dropped here, the
+ *  TWI is switched off and TWI_ERROR is returned. The callback is not
+ *  called in that case.
+ *
+ * Returnvalue:
+ *  One of TWI_IDLE, TWI_BUSY, TWI_DONE or TWI_ERROR.
+ */
+unsigned char twi_status(void);
+
+/*
+ * Description:
+ *  Returns the time the last asynchronous transaction took from START to
+ *  STOP in timer ticks, see my_timers.h. Only valid once twi_status() has
+ *  returned TWI_DONE, or in the callback.
+ */
+uint16_t twi_duration(void);
+
+/*
+ * Description:
+ *  Switches the TWI off, which drops any transaction that is still
+ *  running, and puts the asynchronous engine back to TWI_IDLE.
+ */
+void twi_abort(void);
+
 #endif
@@ -45,4 +45,20 @@
  */
 #define twi_init() { TWBR = _TWBR; SET_BIT_VALUE(TWSR, 0, (1 & _TWPS)); SET_BIT_VALUE(TWSR, 1, (2 & _TWPS) >> 1); }
 
+/*
+ * Description:
+ *  TWBR for the frequency SCL with TWPS = 0, for switching the speed at
+ *  runtime with twi_init_twbr(). The datasheet asks for at least 10 in
+ *  master mode, check it with TWI_TWBR_OK().
+ */
+#define TWI_TWBR(SCL) ((F_CPU - 16ul * (SCL)) / (2ul * (SCL)))
+#define TWI_TWBR_OK(SCL) ((TWI_TWBR(SCL) >= 10) && (TWI_TWBR(SCL) <= 0xff))
+
+/*
+ * Description:
+ *  This macro sets the twi-speed to a value from TWI_TWBR(). The bus has
+ *  to be idle.
+ */
+#define twi_init_twbr(VALUE) { TWBR = (VALUE); CLR_BIT(TWSR, 0); CLR_BIT(TWSR, 1); }
+
 #endif
@@ -95,10 +95,15 @@
  * (e.g. HID), but never want to send any data. This option saves a couple
  * of bytes in flash memory and the transmit buffers in RAM.
  */
+#ifdef USB_POLL_1MS
+#define USB_CFG_INTR_POLL_INTERVAL      1
+#else
 #define USB_CFG_INTR_POLL_INTERVAL      10
+#endif
 /* If you compile a version with endpoint 1 (interrupt-in), this is the poll
  * interval. The value is in milliseconds and must not be less than 10 ms for
- * low speed devices.
+ * low speed devices. USB_POLL_1MS asks for 1 ms anyway, which most hosts
+ * honor for HID devices. See main.c for what else it changes.
  */
 #define USB_CFG_IS_SELF_POWERED         0
 /* Define this to 1 if the device has its own power supply. Set it to 0 if the
@@ -219,6 +224,12 @@
  * obdev's free shared VID/PID pair. See the file USBID-License.txt for
  * details.
  */
+/* The high resolution data format always comes with 8 bit triggers, so it
+ * uses the report variant with analog L and R.
+ */
+#if defined(WII_HIRES) && !defined(WITH_ANALOG_L_R)
+#define WITH_ANALOG_L_R
+#endif
 #ifdef WITH_ANALOG_L_R
 #define USB_CFG_DEVICE_NAME     'c', 'l', 'a', 's', 's', 'i', 'c', '2', 'u', 's', 'b', ' ', '(', 'w', 'i', 't', 'h',\
                                 ' ', 'a', 'n', 'a', 'l', 'o', 'g', ' ', 'l', '+', 'r', ')'